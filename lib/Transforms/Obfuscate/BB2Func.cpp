@@ -1,15 +1,39 @@
+#include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Pass.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/RegionInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 #include "Util.h"
 
 #include <algorithm>
+#include <memory>
+#include <random>
+#include <set>
 #include <vector>
-#include <list>
 
 using namespace llvm;
 
+enum OutlineCC { OutlineC, OutlineFast, OutlineObf };
+static cl::opt<OutlineCC> BB2FuncCC("bb2func-cc", cl::init(OutlineFast),
+    cl::desc("Calling convention of the extracted functions"),
+    cl::values(clEnumValN(OutlineC, "c", "Default C convention"),
+               clEnumValN(OutlineFast, "fast", "fastcc"),
+               clEnumValN(OutlineObf, "obf", "A random OBF_CALL convention (x86 only)")));
+
+static cl::opt<bool> BB2FuncPartialLoops("bb2func-partial-loops", cl::init(false),
+    cl::desc("Also outline parts of loop bodies, penalized by the estimated "
+             "trip count of the loops around them"));
+
 // Stats
 
 namespace {
@@ -19,6 +43,27 @@ struct BB2Func : public FunctionPass {
   BB2Func() : FunctionPass(ID) {}
 
   bool runOnFunction(Function &F) override;
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<RegionInfoPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+  }
+
+  private:
+  // A candidate region with its extractor, scored by the instructions moved
+  // per value marshalled across the call
+  struct Candidate {
+    std::vector<BasicBlock *> blocks;
+    std::unique_ptr<CodeExtractor> CE;
+    double score;
+  };
+  LoopInfo *LI = nullptr;
+  ScalarEvolution *SE = nullptr;
+  double loopPenalty(const std::vector<BasicBlock *> &blocks);
+  void addCandidate(std::vector<BasicBlock *> blocks, std::vector<Candidate> &candidates);
+  void collectRegions(Region *R, std::vector<Candidate> &candidates);
+  Function *returnOutputs(Function *F, unsigned numOutputs);
+  void setCallingConv(Function *F);
 };
 } // namespace
 
@@ -26,50 +71,262 @@ char BB2Func::ID = 0;
 static RegisterPass<BB2Func> X("bb2func", "Split & extract basic blocks to functions");
 Pass *createBB2FuncPass() { return new BB2Func(); }
 
+// How many times the outlined call runs per run of the function: the product
+// of the trip counts of the loops the candidate only covers partially. 0 when
+// such loops are not allowed.
+double BB2Func::loopPenalty(const std::vector<BasicBlock *> &blocks){
+  std::set<BasicBlock *> blockSet(blocks.begin(), blocks.end());
+  std::set<Loop *> loops;
+  for(BasicBlock *BB: blocks){
+    for(Loop *L = LI->getLoopFor(BB); L; L = L->getParentLoop())
+      loops.insert(L);
+  }
+  double executions = 1;
+  for(Loop *L: loops){
+    if(std::all_of(L->block_begin(), L->block_end(),
+                   [&](BasicBlock *BB){ return blockSet.count(BB) > 0; }))
+      continue;
+    if(!BB2FuncPartialLoops)
+      return 0;
+    unsigned trip = SE->getSmallConstantTripCount(L);
+    executions *= trip ? trip : 8;
+  }
+  return executions;
+}
+
+void BB2Func::addCandidate(std::vector<BasicBlock *> blocks, std::vector<Candidate> &candidates){
+  size_t size = 0;
+  for(BasicBlock *BB: blocks){
+    if(BB == &BB->getParent()->getEntryBlock())
+      return;
+    size += BB->size();
+  }
+  if(size <= 4)
+    return;
+  double executions = loopPenalty(blocks);
+  if(executions == 0)
+    return;
+  std::unique_ptr<CodeExtractor> CE(new CodeExtractor(blocks));
+  if(!CE->isEligible())
+    return;
+  SetVector<Value *> inputs, outputs, sinks;
+  CE->findInputsOutputs(inputs, outputs, sinks);
+  Candidate C;
+  C.blocks = std::move(blocks);
+  C.CE = std::move(CE);
+  C.score = (double)size / (inputs.size() + outputs.size() + 1) / executions;
+  candidates.push_back(std::move(C));
+}
+
+void BB2Func::collectRegions(Region *R, std::vector<Candidate> &candidates){
+  for(const std::unique_ptr<Region> &sub: *R){
+    addCandidate(std::vector<BasicBlock *>(sub->block_begin(), sub->block_end()), candidates);
+    collectRegions(sub.get(), candidates);
+  }
+}
+
+static bool isLifetime(User *U){
+  IntrinsicInst *II = dyn_cast<IntrinsicInst>(U);
+  return II && (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+                II->getIntrinsicID() == Intrinsic::lifetime_end);
+}
+
+// Caller slots that CodeExtractor allocates for one output: only passed to
+// the call, reloaded after it and wrapped in lifetime markers
+static bool isOutputSlot(Value *V, CallInst *call){
+  AllocaInst *AI = dyn_cast<AllocaInst>(V);
+  if(!AI)
+    return false;
+  std::set<User *> reloads;
+  for(Instruction *I = call->getNextNode(); I; I = I->getNextNode()){
+    if(isa<LoadInst>(I))
+      reloads.insert(I);
+  }
+  for(User *U: AI->users()){
+    if(U == call || isLifetime(U) || reloads.count(U))
+      continue;
+    BitCastInst *BC = dyn_cast<BitCastInst>(U);
+    if(BC && std::all_of(BC->user_begin(), BC->user_end(), isLifetime))
+      continue;
+    return false;
+  }
+  return true;
+}
+
+// Outputs come back with the return value in one small aggregate instead of
+// through stack slots. When it would not fit in registers the output pointers
+// are marked as the private, fully dereferenceable slots they are.
+// CodeExtractor passes the numOutputs output pointers after the inputs.
+Function *BB2Func::returnOutputs(Function *F, unsigned numOutputs){
+  Module &M = *F->getParent();
+  LLVMContext &C = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  if(!F->hasOneUse())
+    return F;
+  CallInst *call = dyn_cast<CallInst>(F->user_back());
+  if(!call)
+    return F;
+  std::vector<unsigned> outArgs;
+  std::vector<Type *> fields;
+  if(!F->getReturnType()->isVoidTy())
+    fields.push_back(F->getReturnType());
+  for(Argument &A: F->args()){
+    if(A.getArgNo() + numOutputs < F->arg_size())
+      continue;
+    bool onlyStored = std::all_of(A.user_begin(), A.user_end(), [&](User *U){
+      StoreInst *SI = dyn_cast<StoreInst>(U);
+      return SI && SI->isSimple() && SI->getPointerOperand() == &A;
+    });
+    if(onlyStored && isOutputSlot(call->getArgOperand(A.getArgNo()), call)){
+      outArgs.push_back(A.getArgNo());
+      fields.push_back(A.getType()->getPointerElementType());
+    }
+  }
+  if(outArgs.empty())
+    return F;
+  unsigned first = F->getReturnType()->isVoidTy() ? 0 : 1;
+  StructType *retTy = StructType::get(C, fields);
+  if(DL.getTypeAllocSize(retTy) > 16){
+    for(unsigned k = 0; k < outArgs.size(); k++){
+      F->addParamAttr(outArgs[k], Attribute::NoAlias);
+      F->addParamAttr(outArgs[k], Attribute::NoCapture);
+      F->addParamAttr(outArgs[k], Attribute::getWithDereferenceableBytes(
+          C, DL.getTypeStoreSize(fields[first + k])));
+    }
+    return F;
+  }
+
+  std::vector<Type *> paramTy;
+  std::vector<Value *> callArgs;
+  for(Argument &A: F->args()){
+    if(std::find(outArgs.begin(), outArgs.end(), A.getArgNo()) == outArgs.end()){
+      paramTy.push_back(A.getType());
+      callArgs.push_back(call->getArgOperand(A.getArgNo()));
+    }
+  }
+  Function *NF = Function::Create(FunctionType::get(retTy, paramTy, false), F->getLinkage(), "", &M);
+  NF->takeName(F);
+  NF->addAttributes(AttributeList::FunctionIndex, AttrBuilder(F->getAttributes(), AttributeList::FunctionIndex));
+  NF->setSubprogram(F->getSubprogram());
+  NF->getBasicBlockList().splice(NF->begin(), F->getBasicBlockList());
+
+  // Outputs become locals of the callee, promoted once the returns read them
+  Instruction *insertPt = &*NF->getEntryBlock().getFirstInsertionPt();
+  std::vector<AllocaInst *> slots;
+  Function::arg_iterator itArgs = NF->arg_begin();
+  for(Argument &A: F->args()){
+    if(std::find(outArgs.begin(), outArgs.end(), A.getArgNo()) == outArgs.end()){
+      itArgs->takeName(&A);
+      A.replaceAllUsesWith(&*itArgs++);
+    }else{
+      slots.push_back(new AllocaInst(A.getType()->getPointerElementType(),
+                                     DL.getAllocaAddrSpace(), "", insertPt));
+      A.replaceAllUsesWith(slots.back());
+    }
+  }
+  std::vector<ReturnInst *> rets;
+  for(BasicBlock &BB: *NF){
+    if(ReturnInst *RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+      rets.push_back(RI);
+  }
+  for(ReturnInst *RI: rets){
+    Value *ret = UndefValue::get(retTy);
+    if(first)
+      ret = InsertValueInst::Create(ret, RI->getReturnValue(), 0, "", RI);
+    for(unsigned k = 0; k < slots.size(); k++){
+      Value *V = new LoadInst(slots[k]->getAllocatedType(), slots[k], "", RI);
+      ret = InsertValueInst::Create(ret, V, first + k, "", RI);
+    }
+    ReturnInst::Create(C, ret, RI);
+    RI->eraseFromParent();
+  }
+  DominatorTree DT(*NF);
+  PromoteMemToReg(slots, DT);
+
+  CallInst *newCall = CallInst::Create(NF, callArgs, "", call);
+  if(first)
+    call->replaceAllUsesWith(ExtractValueInst::Create(newCall, 0, "", call));
+  for(unsigned k = 0; k < outArgs.size(); k++){
+    AllocaInst *AI = cast<AllocaInst>(call->getArgOperand(outArgs[k]));
+    Value *V = ExtractValueInst::Create(newCall, first + k, "", call);
+    std::vector<Instruction *> dead;
+    for(User *U: AI->users()){
+      if(LoadInst *LI = dyn_cast<LoadInst>(U))
+        LI->replaceAllUsesWith(V);
+      if(U != call)
+        dead.push_back(cast<Instruction>(U));
+    }
+    for(Instruction *I: dead){
+      while(!I->use_empty())
+        cast<Instruction>(I->user_back())->eraseFromParent();
+      I->eraseFromParent();
+    }
+    call->setArgOperand(outArgs[k], UndefValue::get(AI->getType()));
+    AI->eraseFromParent();
+  }
+  call->eraseFromParent();
+  F->eraseFromParent();
+  return NF;
+}
+
+void BB2Func::setCallingConv(Function *F){
+  CallingConv::ID cc = CallingConv::C;
+  if(BB2FuncCC == OutlineFast){
+    cc = CallingConv::Fast;
+  }else if(BB2FuncCC == OutlineObf){
+    Triple::ArchType at = Triple(F->getParent()->getTargetTriple()).getArch();
+    std::uniform_int_distribution<CallingConv::ID> rand(CallingConv::OBF_CALL_START, CallingConv::OBF_CALL_END);
+    cc = (at == Triple::x86_64 || at == Triple::x86) ? rand(getRandomEngine()) : (CallingConv::ID)CallingConv::Fast;
+  }
+  F->setCallingConv(cc);
+  for(User *U: F->users()){
+    if(CallInst *call = dyn_cast<CallInst>(U))
+      call->setCallingConv(cc);
+  }
+}
+
 bool BB2Func::runOnFunction(Function &F) {
   bool modified = false;
-  if(F.getEntryBlock().getName() == "newFuncRoot")
+  if(hasOrigin(&F, "bb2func") || F.getEntryBlock().getName() == "newFuncRoot")
     return modified;
-  std::list<BasicBlock *> bblist;
-  for(Function::iterator i = F.begin(); i != F.end(); ++i){
-    BasicBlock *BB = &*i;
-    if(BB->getInstList().size() > 4){
-      std::vector<BasicBlock *> blocks;
-      blocks.push_back(BB);
-      CodeExtractor CE(blocks);
-      if(CE.isEligible()){
-        bblist.push_back(BB);
-      }
-    }
-  }
-  
+
+  // Single entry single exit regions and single blocks compete on score,
+  // the best ones that do not overlap are extracted
+  LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  std::vector<Candidate> candidates;
+  collectRegions(getAnalysis<RegionInfoPass>().getRegionInfo().getTopLevelRegion(), candidates);
+  for(BasicBlock &BB: F)
+    addCandidate(std::vector<BasicBlock *>(1, &BB), candidates);
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Candidate &a, const Candidate &b){ return a.score > b.score; });
+
   size_t sizeLimit = 16;
-  if(bblist.size() > sizeLimit){
-    bblist.sort([](const BasicBlock *a, const BasicBlock *b){
-              return a->getInstList().size() > b->getInstList().size();});
-    auto it = bblist.begin();
-    std::advance(it, sizeLimit);
-    bblist.erase(it, bblist.end());
-  }
-
-  for(auto it = bblist.begin(); it != bblist.end(); it++){
-    BasicBlock *BB = *it;
-    BasicBlock::iterator itb = BB->getFirstInsertionPt();
-    size_t bbSize = std::distance(itb, BB->end());
-    if(bbSize >= 4){
-      std::advance(itb, bbSize/2 > 8 ? 8 : bbSize/2);
-      bblist.push_back(BB->splitBasicBlock(itb));
-    }
+  std::vector<Candidate *> chosen;
+  std::set<BasicBlock *> taken;
+  for(Candidate &C: candidates){
+    if(chosen.size() >= sizeLimit)
+      break;
+    bool overlap = false;
+    for(BasicBlock *BB: C.blocks)
+      overlap |= taken.count(BB) > 0;
+    if(overlap)
+      continue;
+    taken.insert(C.blocks.begin(), C.blocks.end());
+    chosen.push_back(&C);
   }
 
-  for(BasicBlock *BB: bblist){
-    std::vector<BasicBlock *> blocks;
-    blocks.push_back(BB);
-    CodeExtractor CE(blocks);
-    assert(CE.isEligible());
-    Function *F = CE.extractCodeRegion();
+  for(Candidate *C: chosen){
+    SetVector<Value *> inputs, outputs, sinks;
+    C->CE->findInputsOutputs(inputs, outputs, sinks);
+    Function *F = C->CE->extractCodeRegion();
+    if(!F)
+      continue;
+    F = returnOutputs(F, outputs.size());
     F->addFnAttr(Attribute::NoInline);
+    addOrigin(F, "bb2func");
+    setCallingConv(F);
     modified = true;
   }
   return modified;
-}
\ No newline at end of file
+}
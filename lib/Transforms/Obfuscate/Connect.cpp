@@ -1,17 +1,40 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
 
 #include "Util.h"
 
 #include <algorithm>
 #include <random>
+#include <set>
 #include <vector>
 
 using namespace llvm;
 
+static cl::opt<unsigned> GarbagePoolSize("connect-garbage-pool", cl::init(0),
+    cl::desc("Number of garbage blocks shared by all switches of a function "
+             "(0 = log2 of the number of split blocks)"));
+
+static cl::opt<unsigned> ConnectDegree("connect-degree", cl::init(3),
+    cl::desc("Number of bogus successors added to each split block "
+             "(overridden by the \"connect-degree\" function attribute)"));
+
+static cl::opt<unsigned> HotFreq("connect-hot-freq", cl::init(8),
+    cl::desc("Blocks executed this many times per function entry only use "
+             "single-cycle expressions for the real case value"));
+
+static cl::opt<unsigned> SplitWindow("connect-split-window", cl::init(8),
+    cl::desc("Number of instructions around the middle of a block searched "
+             "for the split point with the fewest live values"));
+
 // Stats
 
 namespace {
@@ -20,10 +43,89 @@ struct Connect : public FunctionPass {
 
   Connect() : FunctionPass(ID) {}
 
+  void getAnalysisUsage(AnalysisUsage &AU) const override{
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  }
+
   bool runOnFunction(Function &F) override;
 };
+
+// Expressions hiding the real case value, numCase op (0|1) or
+// rotate(numCase, 0|0), with a rough latency in cycles.
+// The zeros are left for obfZero.
+enum CaseKind { CaseZero, CaseRotate, CaseOne };
+struct CaseExpr {
+  CaseKind kind;
+  Instruction::BinaryOps op;
+  unsigned latency;
+};
+const CaseExpr caseExprs[] = {
+  {CaseZero, BinaryOperator::Xor, 1},
+  {CaseZero, BinaryOperator::Add, 1},
+  {CaseZero, BinaryOperator::Or, 1},
+  {CaseRotate, BinaryOperator::Or, 1},
+  {CaseOne, BinaryOperator::Mul, 3},
+  {CaseOne, BinaryOperator::UDiv, 26},
+  {CaseOne, BinaryOperator::SDiv, 26},
+};
 } // namespace
 
+// Pick the split point near the middle of BB that leaves the fewest values
+// live across the new edge, since fixStack demotes each of them
+static size_t findSplitPoint(BasicBlock *BB, size_t bbSize){
+  DenseMap<Instruction *, size_t> index;
+  std::vector<Instruction *> insts;
+  for (BasicBlock::iterator it = BB->getFirstInsertionPt(); it != BB->end(); ++it) {
+    index[&*it] = insts.size();
+    insts.push_back(&*it);
+  }
+
+  // live[p] is the number of values defined above p and used at or below p
+  std::vector<int> live(bbSize + 1, 0);
+  for (size_t k = 0; k < bbSize; k++) {
+    size_t last = k;
+    for (User *U: insts[k]->users()) {
+      Instruction *I = cast<Instruction>(U);
+      auto found = index.find(I);
+      if(found != index.end() && !isa<PHINode>(I))
+        last = std::max(last, found->second);
+    }
+    if(last > k){
+      live[k + 1]++;
+      live[last + 1]--;
+    }
+  }
+  for (size_t p = 1; p <= bbSize; p++)
+    live[p] += live[p - 1];
+
+  size_t mid = bbSize / 2;
+  size_t lo = mid > SplitWindow ? mid - SplitWindow : 1;
+  size_t hi = std::min<size_t>(mid + SplitWindow, bbSize - 1);
+  size_t best = mid;
+  for (size_t p = lo; p <= hi; p++) {
+    size_t dist = p > mid ? p - mid : mid - p;
+    size_t bestDist = best > mid ? best - mid : mid - best;
+    if(live[p] < live[best] || (live[p] == live[best] && dist < bestDist))
+      best = p;
+  }
+  return best;
+}
+
+// Upper halves and garbage blocks end in code generated by Connect. Lower
+// halves keep their original terminator but are only reached through the
+// switches, so they are recognized by their predecessors instead
+static bool isConnectBlock(BasicBlock *BB){
+  if(hasOrigin(BB, "connect"))
+    return true;
+  if(pred_empty(BB))
+    return false;
+  for (BasicBlock *pred: predecessors(BB)) {
+    if(!hasOrigin(pred, "connect"))
+      return false;
+  }
+  return true;
+}
+
 char Connect::ID = 0;
 static RegisterPass<Connect> X("connect", "Split & connect basic blocks & add garbage blocks");
 Pass *createConnectPass() { return new Connect(); }
@@ -31,13 +133,20 @@ Pass *createConnectPass() { return new Connect(); }
 bool Connect::runOnFunction(Function &F) {
   Function *f = &F;
   std::vector<BasicBlock *> origBB, downBB, allBB;
+  std::set<BasicBlock *> hotBB;
+  BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
   std::random_device rd;
   std::mt19937 g(rd());
+  unsigned degree = ConnectDegree;
+  if(F.hasFnAttribute("connect-degree"))
+    F.getFnAttribute("connect-degree").getValueAsString().getAsInteger(10, degree);
 
   Function::iterator i = f->begin();
   for (++i; i != f->end(); ++i) {
     BasicBlock *tmp = &*i;
-    origBB.push_back(tmp);
+    // Halves and garbage blocks of an earlier run are not split again
+    if(!isConnectBlock(tmp))
+      origBB.push_back(tmp);
   }
 
   for (std::vector<BasicBlock *>::iterator b = origBB.begin();
@@ -49,7 +158,9 @@ bool Connect::runOnFunction(Function &F) {
       b=origBB.erase(b);
       continue;
     }
-    std::advance(it, bbSize / 2);
+    if(BFI.getBlockFreq(i).getFrequency() >= BFI.getEntryFreq() * HotFreq)
+      hotBB.insert(i);
+    std::advance(it, findSplitPoint(i, bbSize));
     BasicBlock *newBB = i->splitBasicBlock(it);
     downBB.push_back(newBB);
     allBB.push_back(i);
@@ -70,40 +181,80 @@ bool Connect::runOnFunction(Function &F) {
       allBB[num]->moveBefore(shuffleBB[num]);
   }
 
+  // Garbage blocks are shared among all switches, so the junk code grows
+  // with log(n) instead of n
+  size_t poolSize = GarbagePoolSize;
+  if(poolSize == 0)
+    poolSize = Log2_64_Ceil(origBB.size()) + 1;
+  poolSize = std::min(poolSize, origBB.size());
+  std::vector<BasicBlock *> garbageBB;
+  std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
+  for (size_t num = 0; num < poolSize; num++) {
+    BasicBlock *defaultBB = BasicBlock::Create(f->getContext(), "", f,
+                                  shuffleBB[rand(g)%shuffleBB.size()]);
+    setOrigin(CallInst::Create(generateGarbage(f), "", defaultBB), "connect");
+    setOrigin(new UnreachableInst(f->getContext(), defaultBB), "connect");
+    garbageBB.push_back(defaultBB);
+  }
+
+  // Each block gets a fixed number of bogus successors, so the number of
+  // switch cases stays linear in the number of blocks
+  degree = std::min<size_t>(degree, downBB.size() - 1);
   for (size_t num = 0; num < origBB.size(); num++) {
-    std::shuffle(downBB.begin(), downBB.end(), g);
     BasicBlock *i = origBB[num];
     BasicBlock *destBB = i->getTerminator()->getSuccessor(0);
     i->getTerminator()->eraseFromParent();
-    BasicBlock *defaultBB = BasicBlock::Create(f->getContext(), "", f, shuffleBB[num]);
-    CallInst::Create(generateGarbage(f), "", defaultBB);
-    new UnreachableInst(f->getContext(), defaultBB);
+    BasicBlock *defaultBB = garbageBB[rand(g)%garbageBB.size()];
 
-    std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
     ConstantInt *c0 = ConstantInt::get(IntegerType::get(i->getContext(), 32), 0);
     ConstantInt *c1 = ConstantInt::get(IntegerType::get(i->getContext(), 32), 1);
-    SwitchInst *switchII = SwitchInst::Create(c0, defaultBB, 0, i);
-    int garbageCap = downBB.size()/4;
-    garbageCap = garbageCap > 1 ? garbageCap : 1;
-    for (BasicBlock *j: downBB) {
+    SwitchInst *switchII = SwitchInst::Create(c0, defaultBB, degree + 1, i);
+    setOrigin(switchII, "connect");
+    std::vector<BasicBlock *> succBB{destBB};
+    while(succBB.size() <= degree){
+      BasicBlock *j = downBB[rand(g)%downBB.size()];
+      if(std::find(succBB.begin(), succBB.end(), j) == succBB.end())
+        succBB.push_back(j);
+    }
+    std::shuffle(succBB.begin(), succBB.end(), g);
+    // Avoid multiplications and divisions on hot edges
+    std::vector<const CaseExpr *> vecExpr;
+    for (const CaseExpr &e: caseExprs) {
+      if(e.latency == 1 || hotBB.count(i) == 0)
+        vecExpr.push_back(&e);
+    }
+    for (BasicBlock *j: succBB) {
       ConstantInt *numCase = cast<ConstantInt>(ConstantInt::get(
           switchII->getCondition()->getType(),
           rand(g)));
       if(j == destBB){
-        BinaryOperator *tempVal = nullptr;
+        Instruction *tempVal = nullptr;
         std::vector<Instruction::BinaryOps> vecBin{BinaryOperator::Xor, BinaryOperator::Add, BinaryOperator::Or};
-        if(rand(g)%2){
-          std::vector<Instruction::BinaryOps> vec1Bin{BinaryOperator::UDiv, BinaryOperator::Mul, BinaryOperator::SDiv};
-          tempVal = BinaryOperator::Create(vecBin[rand(g)%(vecBin.size())], c0, c0, "", switchII);
-          tempVal->setOperand(rand(g)%2, c1);
-          tempVal = BinaryOperator::Create(vec1Bin[rand(g)%(vec1Bin.size())], numCase, tempVal, "", switchII);
-        }else{
+        const CaseExpr *e = vecExpr[rand(g)%vecExpr.size()];
+        if(e->kind != CaseZero){
           tempVal = BinaryOperator::Create(vecBin[rand(g)%(vecBin.size())], c0, c0, "", switchII);
-          tempVal->setOperand(rand(g)%2, numCase);
+          setOrigin(tempVal, "connect");
+        }
+        switch(e->kind){
+          case CaseZero:
+            tempVal = BinaryOperator::Create(e->op, c0, c0, "", switchII);
+            tempVal->setOperand(rand(g)%2, numCase);
+            break;
+          case CaseRotate:{
+            Function *fshl = Intrinsic::getDeclaration(f->getParent(),
+                                Intrinsic::fshl, {numCase->getType()});
+            tempVal = CallInst::Create(fshl, {numCase, numCase, tempVal}, "", switchII);
+            break;
+          }
+          case CaseOne:
+            tempVal->setOperand(rand(g)%2, c1);
+            tempVal = BinaryOperator::Create(e->op, numCase, tempVal, "", switchII);
+            break;
         }
+        setOrigin(tempVal, "connect");
         switchII->setCondition(tempVal);
         switchII->addCase(numCase, j);
-      }else if(rand(g)%garbageCap == 0){
+      }else{
         switchII->addCase(numCase, j);
       }
     }
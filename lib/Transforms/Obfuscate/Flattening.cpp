@@ -69,6 +69,11 @@ bool Flattening::flatten(Function *f) {
   ConstantInt *primeConst = ConstantInt::get(i32, fnvPrime);
   ConstantInt *basisConst = ConstantInt::get(i32, fnvBasis);
 
+  // A second dispatcher around the first one only adds cost
+  if (hasOrigin(f, "flattening")) {
+    return false;
+  }
+
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
     BasicBlock *tmp = &*i;
@@ -239,6 +244,10 @@ bool Flattening::flatten(Function *f) {
     BranchInst::Create(loopEntry, i);
   }
 
+  for (Instruction &I: *loopEntry)
+    setOrigin(&I, "flattening");
+  addOrigin(f, "flattening");
+
   fixStack(f);
 
   return true;
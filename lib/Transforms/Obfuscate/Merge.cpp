@@ -2,14 +2,41 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 
+#include "Util.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <set>
+#include <tuple>
 #include <vector>
 #include <random>
 
 using namespace llvm;
 
+static cl::opt<bool> MergeCluster("merge-cluster", cl::init(false),
+    cl::desc("Group functions by call graph affinity into several merged "
+             "functions instead of a single one"));
+
+static cl::opt<unsigned> MergePacked("merge-packed", cl::init(0),
+    cl::desc("Pass the arguments through a pointer to a packed struct when "
+             "the merged signature needs more slots than this (0 = never)"));
+
+static cl::opt<bool> MergeDirectCalls("merge-direct-calls", cl::init(false),
+    cl::desc("Keep functions called from inside their group outside of tail "
+             "position out of the merged body, so those calls skip the "
+             "dispatch (trades hiding for speed)"));
+
+static cl::opt<unsigned> MergeMaxSize("merge-max-size", cl::init(2000),
+    cl::desc("Maximum number of instructions of a merged function in "
+             "cluster mode"));
+
 namespace {
   struct Merge : public ModulePass {
     static char ID;
@@ -17,147 +44,341 @@ namespace {
 
     bool runOnModule(Module &M) override;
 
-    std::vector<Function *> mergeList;
+    private:
+    std::vector<std::vector<Function *>> clusterFunctions(std::vector<Function *> &candidates);
+    bool mergeGroup(std::vector<Function *> &mergeList, Module &M);
   };
 }
 
 char Merge::ID = 0;
 static RegisterPass<Merge> X("merge", "Merge static functions");
 
+static unsigned countInstructions(Function *F){
+  unsigned n = 0;
+  for(BasicBlock &BB: *F)
+    n += BB.size();
+  return n;
+}
+
+// Greedy agglomerative clustering: the heaviest call edges are merged first
+// as long as the cluster stays under MergeMaxSize. Callees called next to each
+// other from the same function are also tied together. Leftover singletons
+// are packed in module order.
+std::vector<std::vector<Function *>> Merge::clusterFunctions(std::vector<Function *> &candidates){
+  std::map<Function *, unsigned> index;
+  for(unsigned i = 0; i < candidates.size(); i++)
+    index[candidates[i]] = i;
+  std::map<std::pair<unsigned, unsigned>, unsigned> affinity;
+  auto addEdge = [&](unsigned a, unsigned b){
+    if(a != b)
+      affinity[std::make_pair(std::min(a, b), std::max(a, b))]++;
+  };
+  Module &M = *candidates[0]->getParent();
+  for(Function &F: M){
+    auto caller = index.find(&F);
+    int last = -1;
+    for(BasicBlock &BB: F){
+      for(Instruction &I: BB){
+        CallInst *call = dyn_cast<CallInst>(&I);
+        if(!call || !call->getCalledFunction())
+          continue;
+        auto callee = index.find(call->getCalledFunction());
+        if(callee == index.end())
+          continue;
+        if(caller != index.end())
+          addEdge(caller->second, callee->second);
+        if(last >= 0)
+          addEdge(last, callee->second);
+        last = callee->second;
+      }
+    }
+  }
+
+  std::vector<std::tuple<unsigned, unsigned, unsigned>> edges;
+  for(auto &e: affinity)
+    edges.push_back(std::make_tuple(e.second, e.first.first, e.first.second));
+  std::stable_sort(edges.begin(), edges.end(),
+                   [](const std::tuple<unsigned, unsigned, unsigned> &a,
+                      const std::tuple<unsigned, unsigned, unsigned> &b){
+                     return std::get<0>(a) > std::get<0>(b);
+                   });
+
+  std::vector<unsigned> parent(candidates.size()), size(candidates.size());
+  std::iota(parent.begin(), parent.end(), 0);
+  for(unsigned i = 0; i < candidates.size(); i++)
+    size[i] = countInstructions(candidates[i]);
+  auto find = [&](unsigned x){
+    while(parent[x] != x)
+      x = parent[x] = parent[parent[x]];
+    return x;
+  };
+  for(auto &e: edges){
+    unsigned a = find(std::get<1>(e)), b = find(std::get<2>(e));
+    if(a == b || size[a] + size[b] > MergeMaxSize)
+      continue;
+    parent[b] = a;
+    size[a] += size[b];
+  }
+
+  std::map<unsigned, std::vector<Function *>> groups;
+  for(unsigned i = 0; i < candidates.size(); i++)
+    groups[find(i)].push_back(candidates[i]);
+  std::vector<std::vector<Function *>> clusters;
+  std::vector<Function *> rest;
+  unsigned restSize = 0;
+  for(auto &group: groups){
+    if(group.second.size() > 1){
+      clusters.push_back(group.second);
+      continue;
+    }
+    Function *F = group.second[0];
+    if(!rest.empty() && restSize + size[index[F]] > MergeMaxSize){
+      clusters.push_back(rest);
+      rest.clear();
+      restSize = 0;
+    }
+    rest.push_back(F);
+    restSize += size[index[F]];
+  }
+  if(!rest.empty())
+    clusters.push_back(rest);
+  return clusters;
+}
+
+static bool hasAddressTakenBlock(Function &F){
+  for(BasicBlock &BB: F){
+    if(BB.hasAddressTaken())
+      return true;
+  }
+  return false;
+}
+
 bool Merge::runOnModule(Module &M){
+  std::vector<Function *> candidates;
   for(Function &F: M){
-    if(F.getLinkage() == GlobalValue::InternalLinkage && !F.isVarArg()
-          && (F.getReturnType()->isIntOrPtrTy() || F.getReturnType()->isVoidTy())){
-      mergeList.push_back(&F);
+    // A merged function is never merged again, the dispatch would nest
+    if(F.getLinkage() != GlobalValue::InternalLinkage || F.isVarArg()
+          || F.getReturnType()->isTokenTy() || hasOrigin(&F, "merge"))
+      continue;
+    // Blockaddresses keep pointing into the original body after inlining,
+    // so the VM interpreter and other indirectbr users stay separate
+    if(hasOrigin(&F, "vm") || hasAddressTakenBlock(F))
+      continue;
+    // Indirect callers would still expect the original signature
+    if(F.hasAddressTaken())
+      continue;
+    candidates.push_back(&F);
+  }
+
+  if(candidates.size() < 2)
+    return false;
+  if(!MergeCluster)
+    return mergeGroup(candidates, M);
+
+  bool modified = false;
+  for(std::vector<Function *> &group: clusterFunctions(candidates))
+    modified |= mergeGroup(group, M);
+  return modified;
+}
+
+// Parameters of the same class share slots across the merged functions:
+// each class gets as many slots as the function using it the most. Pointers
+// stay pointers so bitcasts keep their provenance for alias analysis.
+static Type *slotType(Type *ty){
+  if(PointerType *pt = dyn_cast<PointerType>(ty))
+    return Type::getInt8PtrTy(ty->getContext(), pt->getAddressSpace());
+  return ty;
+}
+
+static Value *castSlot(Value *V, Type *ty, BasicBlock::iterator before){
+  if(V->getType() == ty)
+    return V;
+  return new BitCastInst(V, ty, "", &*before);
+}
+
+// Frame objects only ever loaded from or stored to can be reused when a tail
+// call becomes a jump
+static bool hasEscapingAlloca(Function *F){
+  for(BasicBlock &BB: *F){
+    for(Instruction &I: BB){
+      AllocaInst *AI = dyn_cast<AllocaInst>(&I);
+      if(!AI)
+        continue;
+      for(User *U: AI->users()){
+        StoreInst *SI = dyn_cast<StoreInst>(U);
+        if(!isa<LoadInst>(U) && !(SI && SI->getPointerOperand() == AI))
+          return true;
+      }
     }
   }
+  return false;
+}
 
+bool Merge::mergeGroup(std::vector<Function *> &mergeList, Module &M){
   if(mergeList.size() < 2)
     return false;
 
-  size_t retBitLen = 64;
-  std::string funcName = "";
-  std::vector<uint32_t> funcID;
-  std::random_device rd;
-  std::mt19937 g(rd());
+  // The symbol only carries a hash of the merged names, whatever their number
+  uint32_t nameHash = fnvBasis;
+  // Cases are numbered densely in a random order so the dispatch switch
+  // becomes a jump table. Call sites pass (index ^ key) * mul, which the
+  // merged entry decodes with one multiply and one xor.
+  std::mt19937 &g = getRandomEngine();
   std::uniform_int_distribution<uint32_t> rand(0, UINT32_MAX);
-  std::vector<Type *> paramTy;
-  int ni32 = 0, ni64 = 0;
-  std::vector<Type *> OtherTypes;
+  std::vector<uint32_t> caseIdx(mergeList.size()), funcID;
+  std::iota(caseIdx.begin(), caseIdx.end(), 0);
+  std::shuffle(caseIdx.begin(), caseIdx.end(), g);
+  uint32_t idKey = rand(g), idMul = rand(g) | 1, idMulInv = idMul;
+  for(int i = 0; i < 5; i++)
+    idMulInv *= 2 - idMul * idMulInv;
   IntegerType *i32 = IntegerType::get(M.getContext(), 32);
-  IntegerType *i64 = IntegerType::get(M.getContext(), 64);
-  paramTy.push_back(i32);
-  for(Function *f: mergeList){
-    if(IntegerType *ty = dyn_cast<IntegerType>(f->getReturnType())){
-      if(ty->getBitWidth() > retBitLen){
-        retBitLen = ty->getBitWidth();
-      }
-    }
-    int nfi32 = 0, nfi64 = 0;
+  Type *i8p = Type::getInt8PtrTy(M.getContext());
+
+  // argSlot[i][j] is the slot of the j-th parameter of mergeList[i]
+  std::vector<Type *> slotTy;
+  std::map<Type *, std::vector<unsigned>> slotsOfClass;
+  std::vector<std::vector<unsigned>> argSlot(mergeList.size());
+  for(size_t i = 0; i < mergeList.size(); i++){
+    Function *f = mergeList[i];
+    std::map<Type *, unsigned> used;
     for(Type *ty: f->getFunctionType()->params()){
-      if(IntegerType *ti = dyn_cast<IntegerType>(ty)){
-        if(ti->getBitWidth() == 32){
-          nfi32++;
-        }else if(ti->getBitWidth() == 64){
-          nfi64++;
-        }else{
-          OtherTypes.push_back(ty);
-        }
-      }else if(isa<PointerType>(ty)){
-        nfi64++;
-      }else{
-        OtherTypes.push_back(ty);
+      Type *cls = slotType(ty);
+      std::vector<unsigned> &slots = slotsOfClass[cls];
+      unsigned n = used[cls]++;
+      if(n == slots.size()){
+        slots.push_back(slotTy.size());
+        slotTy.push_back(cls);
       }
+      argSlot[i].push_back(slots[n]);
     }
-    if(nfi32 > ni32) ni32 = nfi32;
-    if(nfi64 > ni64) ni64 = nfi64;
-    funcName += std::string(f->getName()) + ".";
-    funcID.push_back(rand(g));
+    for(char c: f->getName())
+      nameHash = fnvHash((unsigned char)c, nameHash);
+    funcID.push_back((caseIdx[i] ^ idKey) * idMul);
   }
-  for(int i=0; i<ni32; i++){paramTy.push_back(i32);}
-  for(int i=0; i<ni64; i++){paramTy.push_back(i64);}
-  for(Type *ty: OtherTypes){paramTy.push_back(ty);}
-  IntegerType *retTy = IntegerType::get(M.getContext(), retBitLen);
+  // Wide signatures are passed as a pointer to a per-function packed struct
+  bool packed = MergePacked && slotTy.size() > MergePacked;
+  std::vector<Type *> paramTy;
+  paramTy.push_back(i32);
+  if(packed)
+    paramTy.push_back(i8p);
+  else
+    paramTy.insert(paramTy.end(), slotTy.begin(), slotTy.end());
+  // Return values share one field per type, like a union: nothing is widened.
+  // Fields fitting in 16 bytes together come back in registers, anything
+  // larger goes through a buffer in the caller's frame.
+  std::vector<Type *> retFields;
+  std::vector<int> retField(mergeList.size(), -1);
+  for(size_t i = 0; i < mergeList.size(); i++){
+    Type *ty = mergeList[i]->getReturnType();
+    if(ty->isVoidTy())
+      continue;
+    Type *cls = slotType(ty);
+    auto found = std::find(retFields.begin(), retFields.end(), cls);
+    retField[i] = found - retFields.begin();
+    if(found == retFields.end())
+      retFields.push_back(cls);
+  }
+  bool retBuffer = retFields.size() > 1 &&
+      M.getDataLayout().getTypeAllocSize(StructType::get(M.getContext(), retFields)) > 16;
+  Type *retTy = Type::getVoidTy(M.getContext());
+  if(retBuffer)
+    paramTy.insert(paramTy.begin() + 1, i8p);
+  else if(retFields.size() == 1)
+    retTy = retFields[0];
+  else if(retFields.size() > 1)
+    retTy = StructType::get(M.getContext(), retFields);
+  unsigned argBase = retBuffer ? 2 : 1;
   FunctionType *funcTy = FunctionType::get(retTy, paramTy, false);
-  Function *newFunction = Function::Create(funcTy, GlobalValue::InternalLinkage, funcName + "merge", M);
+  Function *newFunction = Function::Create(funcTy, GlobalValue::InternalLinkage, "merge." + utohexstr(nameHash), M);
+  addOrigin(newFunction, "merge");
   newFunction->addFnAttr(Attribute::NoInline);
 
+  // Call rewriting fills the slots in argSlot of this one buffer and puts
+  // undef back afterwards, the rest is never touched
+  std::vector<Value *> padding(argBase + slotTy.size());
+  for(size_t k = 0; k < slotTy.size(); k++)
+    padding[argBase + k] = UndefValue::get(slotTy[k]);
+  std::set<Function *> members(mergeList.begin(), mergeList.end());
+  MDNode *tailMD = MDNode::get(M.getContext(), {});
+  auto isTailCall = [&](CallInst *call){
+    ReturnInst *RI = dyn_cast<ReturnInst>(call->getNextNode());
+    return !packed && !retBuffer && members.count(call->getFunction()) && RI &&
+           (RI->getNumOperands() ? RI->getReturnValue() == call : call->getType()->isVoidTy());
+  };
+  // Members called from the group outside of tail position, e.g. by tree
+  // walkers, keep their body in a separate entry. Those calls go straight to
+  // it without id, switch or padding, outside callers still use the id.
+  std::vector<bool> direct(mergeList.size(), false);
+  if(MergeDirectCalls){
+    for(size_t i = 0; i < mergeList.size(); i++){
+      for(User *U: mergeList[i]->users()){
+        CallInst *call = dyn_cast<CallInst>(U);
+        if(call && members.count(call->getFunction()) && !isTailCall(call))
+          direct[i] = true;
+      }
+    }
+  }
   for(size_t i = 0; i < mergeList.size(); i++){
     std::vector<CallInst*> vecCall;
     for(Use &U: mergeList[i]->uses()){
       CallInst *call = dyn_cast<CallInst>(U.getUser());
-      if(!call){
+      if(!call || call->getCalledOperand() != mergeList[i]){
         errs() << "Not a call instruction use" << *(U.getUser()) << "\n";
-      }else{
+      }else if(!direct[i] || !members.count(call->getFunction())){
         vecCall.push_back(call);
       }
     }
+    StructType *argsTy = StructType::get(M.getContext(), mergeList[i]->getFunctionType()->params());
     for(CallInst *call: vecCall){
       ConstantInt *numCase = ConstantInt::get(i32, funcID[i]);
-      std::vector<Value*> callArgs;
-      std::vector<Value*> i32Args;
-      std::vector<Value*> i64Args;
-      std::vector<Value*> otherArgs;
-      callArgs.push_back(numCase);
-      for(Value *arg: call->args()){
-        Type *ty = arg->getType();
-        if(IntegerType *ti = dyn_cast<IntegerType>(ty)){
-          if(ti->getBitWidth() == 32){
-            i32Args.push_back(arg);
-          }else if(ti->getBitWidth() == 64){
-            i64Args.push_back(arg);
-          }else{
-            otherArgs.push_back(arg);
-          }
-        }else if(isa<PointerType>(ty)){
-          i64Args.push_back(new PtrToIntInst(arg, i64, "", call));
-        }else{
-          otherArgs.push_back(arg);
-        }
-      }
-      for(int i = 0; i < ni32; i++){
-        if(i < (int)i32Args.size()){
-          callArgs.push_back(i32Args[i]);
-        }else{
-          callArgs.push_back(Constant::getNullValue(i32));
-        }
+      Type *ty = mergeList[i]->getReturnType();
+      BasicBlock &callerEntry = call->getFunction()->getEntryBlock();
+      AllocaInst *buffer = nullptr;
+      Value *bufferArg = nullptr;
+      if(retBuffer && !ty->isVoidTy()){
+        buffer = new AllocaInst(ty, M.getDataLayout().getAllocaAddrSpace(), "",
+                                &*callerEntry.getFirstInsertionPt());
+        bufferArg = castSlot(buffer, i8p, call->getIterator());
+      }else if(retBuffer){
+        bufferArg = ConstantPointerNull::get(cast<PointerType>(i8p));
       }
-      for(int i = 0; i < ni64; i++){
-        if(i < (int)i64Args.size()){
-          callArgs.push_back(i64Args[i]);
-        }else{
-          callArgs.push_back(Constant::getNullValue(i64));
+      std::vector<Value*> callArgs;
+      CallInst *newCall;
+      if(packed){
+        callArgs.push_back(numCase);
+        if(retBuffer)
+          callArgs.push_back(bufferArg);
+        AllocaInst *args = new AllocaInst(argsTy, M.getDataLayout().getAllocaAddrSpace(), "",
+                                          &*callerEntry.getFirstInsertionPt());
+        for(unsigned j = 0; j < call->arg_size(); j++){
+          Value *field = GetElementPtrInst::CreateInBounds(argsTy, args,
+              {ConstantInt::get(i32, 0), ConstantInt::get(i32, j)}, "", call);
+          new StoreInst(call->getArgOperand(j), field, call);
         }
-      }
-      for(Function *f: mergeList){
-        if(f != mergeList[i]){
-          for(Type *ty: f->getFunctionType()->params()){
-            if(IntegerType *ti = dyn_cast<IntegerType>(ty)){
-              if(ti->getBitWidth() == 32 || ti->getBitWidth() == 64){
-                continue;
-              }
-            }else if(isa<PointerType>(ty)){
-              continue;
-            }
-            callArgs.push_back(Constant::getNullValue(ty));
-          }
-        }else{
-          for(Value *arg: otherArgs){
-            callArgs.push_back(arg);
-          }
+        callArgs.push_back(new BitCastInst(args, i8p, "", call));
+        newCall = CallInst::Create(newFunction, callArgs, "", call);
+      }else{
+        padding[0] = numCase;
+        if(retBuffer)
+          padding[1] = bufferArg;
+        for(unsigned j = 0; j < call->arg_size(); j++){
+          padding[argBase + argSlot[i][j]] = castSlot(call->getArgOperand(j), slotTy[argSlot[i][j]],
+                                                call->getIterator());
         }
+        newCall = CallInst::Create(newFunction, padding, "", call);
+        for(unsigned j = 0; j < call->arg_size(); j++)
+          padding[argBase + argSlot[i][j]] = UndefValue::get(slotTy[argSlot[i][j]]);
       }
-      CallInst *newCall = CallInst::Create(newFunction, callArgs, "", call);
       //errs() << "Replacing" << *call << " with" << *newCall << "\n";
-      if(mergeList[i]->getReturnType()->isVoidTy()){
-      }else if(mergeList[i]->getReturnType()->isPointerTy()){
-        Value *replaced = new IntToPtrInst(newCall, mergeList[i]->getReturnType(), "", call);
-        call->replaceAllUsesWith(replaced);
-      }else if(cast<IntegerType>(mergeList[i]->getReturnType())->getBitWidth() < retBitLen){
-        Value *replaced = new TruncInst(newCall, mergeList[i]->getReturnType(), "", call);
-        call->replaceAllUsesWith(replaced);
-      }else{
-        call->replaceAllUsesWith(newCall);
+      if(isTailCall(call))
+        newCall->setMetadata("merge.tail", tailMD);
+      if(buffer){
+        call->replaceAllUsesWith(new LoadInst(ty, buffer, "", call));
+      }else if(!ty->isVoidTy()){
+        Value *replaced = newCall;
+        if(retTy->isStructTy())
+          replaced = ExtractValueInst::Create(replaced, retField[i], "", call);
+        call->replaceAllUsesWith(castSlot(replaced, ty, call->getIterator()));
       }
       call->eraseFromParent();
     }
@@ -165,71 +386,118 @@ bool Merge::runOnModule(Module &M){
 
   BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", newFunction);
   BasicBlock *switchB = BasicBlock::Create(M.getContext(), "switch", newFunction);
+  BasicBlock *badID = BasicBlock::Create(M.getContext(), "", newFunction);
+  new UnreachableInst(M.getContext(), badID);
   BranchInst::Create(switchB, entry);
-  SwitchInst *switchI = SwitchInst::Create(newFunction->arg_begin(), switchB, 0, switchB);
+  Value *decoded = BinaryOperator::CreateMul(newFunction->arg_begin(),
+                                             ConstantInt::get(i32, idMulInv), "", switchB);
+  decoded = BinaryOperator::CreateXor(decoded, ConstantInt::get(i32, idKey), "", switchB);
+  SwitchInst *switchI = SwitchInst::Create(decoded, badID, mergeList.size(), switchB);
+  std::vector<Argument *> slotArgs;
+  for(Argument &arg: newFunction->args())
+    slotArgs.push_back(&arg);
+  // Each case starts with one phi per parameter so tail calls can jump in
+  std::vector<BasicBlock *> caseHead(mergeList.size());
+  std::vector<std::vector<PHINode *>> headPhis(mergeList.size());
   for(size_t i = 0; i < mergeList.size(); i++){
     BasicBlock *callFunc = BasicBlock::Create(M.getContext(), "", newFunction, switchB);
-    Function::arg_iterator iti32Args = newFunction->arg_begin();
-    std::advance(iti32Args, 1);
-    Function::arg_iterator iti64Args = newFunction->arg_begin();
-    std::advance(iti64Args, 1+ni32);
-    Function::arg_iterator itotherArgs = newFunction->arg_begin();
-    std::advance(itotherArgs, 1+ni32+ni64);
-    for(Function *f: mergeList){
-      if(f != mergeList[i]){
-        for(Type *ty: f->getFunctionType()->params()){
-          if(IntegerType *ti = dyn_cast<IntegerType>(ty)){
-            if(ti->getBitWidth() == 32 || ti->getBitWidth() == 64){
-              continue;
-            }
-          }else if(isa<PointerType>(ty)){
-            continue;
-          }
-          itotherArgs++;
-        }
-      }else{
-        break;
-      }
-    }
+    caseHead[i] = callFunc;
     std::vector<Value*> callArgs;
-    for(Argument &argument: mergeList[i]->args()){
-      Value *arg = &argument;
-      Type *ty = arg->getType();
-      if(IntegerType *ti = dyn_cast<IntegerType>(ty)){
-        if(ti->getBitWidth() == 32){
-          callArgs.push_back(iti32Args++);
-        }else if(ti->getBitWidth() == 64){
-          callArgs.push_back(iti64Args++);
-        }else{
-          callArgs.push_back(itotherArgs++);
-        }
-      }else if(isa<PointerType>(ty)){
-        callArgs.push_back(new IntToPtrInst(iti64Args++, ty, "", callFunc));
-      }else{
-        callArgs.push_back(itotherArgs++);
+    if(packed){
+      StructType *argsTy = StructType::get(M.getContext(), mergeList[i]->getFunctionType()->params());
+      Value *args = new BitCastInst(slotArgs[argBase], argsTy->getPointerTo(), "", callFunc);
+      for(unsigned j = 0; j < mergeList[i]->arg_size(); j++){
+        Value *field = GetElementPtrInst::CreateInBounds(argsTy, args,
+            {ConstantInt::get(i32, 0), ConstantInt::get(i32, j)}, "", callFunc);
+        callArgs.push_back(new LoadInst(argsTy->getElementType(j), field, "", callFunc));
+      }
+    }else{
+      for(Argument &argument: mergeList[i]->args()){
+        PHINode *phi = PHINode::Create(slotTy[argSlot[i][argument.getArgNo()]], 1, "", callFunc);
+        phi->addIncoming(slotArgs[argBase + argSlot[i][argument.getArgNo()]], switchB);
+        headPhis[i].push_back(phi);
+      }
+      // Casts go after the last phi
+      for(Argument &argument: mergeList[i]->args()){
+        Value *arg = headPhis[i][argument.getArgNo()];
+        if(arg->getType() != argument.getType())
+          arg = new BitCastInst(arg, argument.getType(), "", callFunc);
+        callArgs.push_back(arg);
       }
     }
     CallInst *callI = CallInst::Create(mergeList[i], callArgs, "", callFunc);
-    if(mergeList[i]->getReturnType()->isVoidTy()){
-      ReturnInst::Create(M.getContext(), ConstantInt::get(retTy, 0), callFunc);
-    }else if(mergeList[i]->getReturnType()->isPointerTy()){
-      ReturnInst::Create(M.getContext(),
-            new PtrToIntInst(callI, retTy, "", callFunc), callFunc);
-    }else if(cast<IntegerType>(mergeList[i]->getReturnType())->getBitWidth() < retBitLen){
-      ReturnInst::Create(M.getContext(),
-            new ZExtInst(callI, retTy, "", callFunc), callFunc);
+    Type *ty = mergeList[i]->getReturnType();
+    if(retBuffer && !ty->isVoidTy()){
+      new StoreInst(callI, new BitCastInst(slotArgs[1], ty->getPointerTo(), "", callFunc), callFunc);
+      ReturnInst::Create(M.getContext(), callFunc);
+    }else if(retTy->isVoidTy()){
+      ReturnInst::Create(M.getContext(), callFunc);
+    }else if(ty->isVoidTy()){
+      ReturnInst::Create(M.getContext(), UndefValue::get(retTy), callFunc);
     }else{
-      ReturnInst::Create(M.getContext(), callI, callFunc);
+      Value *ret = callI;
+      if(ty != retFields[retField[i]])
+        ret = new BitCastInst(ret, retFields[retField[i]], "", callFunc);
+      if(retTy->isStructTy())
+        ret = InsertValueInst::Create(UndefValue::get(retTy), ret, retField[i], "", callFunc);
+      ReturnInst::Create(M.getContext(), ret, callFunc);
     }
     ConstantInt *numCase = cast<ConstantInt>(ConstantInt::get(
         switchI->getCondition()->getType(),
-        funcID[i]));
+        caseIdx[i]));
     switchI->addCase(numCase, callFunc);
+    if(direct[i]){
+      uint32_t entryHash = nameHash;
+      for(char c: mergeList[i]->getName())
+        entryHash = fnvHash((unsigned char)c, entryHash);
+      mergeList[i]->setName("merge." + utohexstr(nameHash) + "." + utohexstr(entryHash));
+      mergeList[i]->addFnAttr(Attribute::NoInline);
+      addOrigin(mergeList[i], "merge");
+      continue;
+    }
     InlineFunctionInfo IFI;
     InlineFunction(callI, IFI);
   }
 
+  // Calls inside the group in tail position skip the entry: no id decoding,
+  // no switch, the arguments go straight into the phis of the target case
+  if(!packed && !hasEscapingAlloca(newFunction)){
+    std::vector<CallInst *> tails;
+    for(BasicBlock &BB: *newFunction){
+      for(Instruction &I: BB){
+        CallInst *CI = dyn_cast<CallInst>(&I);
+        if(CI && CI->getCalledFunction() == newFunction && CI->getMetadata("merge.tail"))
+          tails.push_back(CI);
+      }
+    }
+    std::map<uint32_t, size_t> caseOf;
+    for(size_t i = 0; i < mergeList.size(); i++)
+      caseOf[caseIdx[i]] = i;
+    for(CallInst *CI: tails){
+      uint32_t id = cast<ConstantInt>(CI->getArgOperand(0))->getZExtValue();
+      size_t i = caseOf[(id * idMulInv) ^ idKey];
+      BasicBlock *BB = CI->getParent();
+      BB->splitBasicBlock(CI);
+      BB->getTerminator()->eraseFromParent();
+      BranchInst::Create(caseHead[i], BB);
+      for(size_t j = 0; j < headPhis[i].size(); j++)
+        headPhis[i][j]->addIncoming(CI->getArgOperand(argBase + argSlot[i][j]), BB);
+      if(!CI->getType()->isVoidTy())
+        CI->replaceAllUsesWith(UndefValue::get(CI->getType()));
+      CI->eraseFromParent();
+    }
+    if(!tails.empty())
+      removeUnreachableBlocks(*newFunction);
+  }
+  // Calls left in place keep no trace of the rewrite
+  for(User *U: newFunction->users()){
+    if(CallInst *CI = dyn_cast<CallInst>(U))
+      CI->setMetadata("merge.tail", nullptr);
+  }
+
   for(size_t i = 0; i < mergeList.size(); i++){
+    if(direct[i])
+      continue;
     if(mergeList[i]->isDefTriviallyDead()){
       mergeList[i]->eraseFromParent();
     }else{
@@ -241,4 +509,4 @@ bool Merge::runOnModule(Module &M){
   }
 
   return true;
-}
\ No newline at end of file
+}
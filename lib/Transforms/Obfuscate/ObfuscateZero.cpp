@@ -1,5 +1,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include "Util.h"
@@ -9,47 +11,101 @@
 
 using namespace llvm;
 
+static cl::opt<unsigned> ZeroPoolSize("obfzero-pool", cl::init(0),
+    cl::desc("Reuse at most this many opaque zeros along each dominator "
+             "tree path (0 = a fresh expression for every zero)"));
+
+static cl::opt<MBACost> ZeroCost("obfzero-mba", cl::init(MBAMedium),
+    cl::desc("Strength of the MBA identities hiding zeros"),
+    cl::values(clEnumValN(MBACheap, "cheap", "1-2 extra instructions"),
+               clEnumValN(MBAMedium, "medium", "One identity of at most 4 cycles per operator"),
+               clEnumValN(MBAHeavy, "heavy", "Nested identities")));
+
+static cl::opt<unsigned> MaxCandidates("obfzero-candidates", cl::init(32),
+    cl::desc("Number of integer values sampled per block as inputs of "
+             "opaque expressions"));
+
 namespace {
-  class ObfuscateZero : public BasicBlockPass {
+  class ObfuscateZero : public FunctionPass {
     private:
     std::vector<Value *> IntegerVect;
+    size_t IntegerSeen = 0;
+    std::vector<Value *> ZeroPool;
     std::default_random_engine Generator;
 
     public:
     static char ID;
-    ObfuscateZero() : BasicBlockPass(ID) {}
-    bool runOnBasicBlock(BasicBlock &BB) override;
+    ObfuscateZero() : FunctionPass(ID) {}
+    void getAnalysisUsage(AnalysisUsage &AU) const override{
+      AU.addRequired<DominatorTreeWrapperPass>();
+      AU.setPreservesCFG();
+    }
+    bool runOnFunction(Function &F) override;
 
     private:
+    bool runOnBasicBlock(BasicBlock &BB);
     bool isValidCandidateInstruction(Instruction &Inst) const;
-    ConstantInt *isValidCandidateOperand(Value *V) const;
+    Constant *isValidCandidateOperand(Value *V) const;
     void registerInteger(Value &V);
+    Value *getZero(Instruction &Inst, Constant *VReplace);
     Value *replaceZero(Instruction &Inst, ConstantInt *VReplace);
     Value *createExpression(Value* x, const uint32_t p, IRBuilder<>& Builder);
   };
 }
 
+bool ObfuscateZero::runOnFunction(Function &F) {
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  bool modified = false;
+
+  // Walk the dominator tree so that pooled zeros always dominate their uses.
+  // Each node remembers the pool size at the end of its idom.
+  ZeroPool.clear();
+  std::vector<std::pair<DomTreeNode *, size_t>> worklist;
+  worklist.push_back(std::make_pair(DT.getRootNode(), 0));
+  while(!worklist.empty()){
+    DomTreeNode *N = worklist.back().first;
+    ZeroPool.resize(worklist.back().second);
+    worklist.pop_back();
+    modified |= runOnBasicBlock(*N->getBlock());
+    for(DomTreeNode *child: *N)
+      worklist.push_back(std::make_pair(child, ZeroPool.size()));
+  }
+  return modified;
+}
+
 bool ObfuscateZero::runOnBasicBlock(BasicBlock &BB) {
   IntegerVect.clear();
+  IntegerSeen = 0;
   bool modified = false;
 
   for (BasicBlock::iterator I = BB.getFirstInsertionPt(),
       end = BB.end();
       I != end; ++I) {
     Instruction &Inst = *I;
-    if (isValidCandidateInstruction(Inst)) {
+    // Expressions built by an earlier run are left alone, otherwise every
+    // run would obfuscate the constants inside the previous ones
+    if (!hasOrigin(&Inst, "obfZero") && isValidCandidateInstruction(Inst)) {
+      Instruction *prev = Inst.getPrevNode();
       size_t opSize = Inst.getNumOperands();
       //Do not obfuscate switch cases
       if (isa<SwitchInst>(&Inst))
         opSize = 1;
+      //Keep lane indices constant
+      else if (isa<ExtractElementInst>(&Inst))
+        opSize = 1;
+      else if (isa<InsertElementInst>(&Inst))
+        opSize = 2;
       for (size_t i = 0; i < opSize; ++i) {
-        if (ConstantInt *C = isValidCandidateOperand(Inst.getOperand(i))) {
-          if (Value *New_val = replaceZero(Inst, C)) {
+        if (Constant *C = isValidCandidateOperand(Inst.getOperand(i))) {
+          if (Value *New_val = getZero(Inst, C)) {
             Inst.setOperand(i, New_val);
             modified = true;
           }
         }
       }
+      for (Instruction *New = prev ? prev->getNextNode() : &BB.front();
+           New != &Inst; New = New->getNextNode())
+        setOrigin(New, "obfZero");
     }
     registerInteger(Inst);
   }
@@ -65,14 +121,18 @@ bool ObfuscateZero::isValidCandidateInstruction(Instruction &Inst) const {
     return false;
   } else if (isa<CallInst>(&Inst)) {
     return false;
+  } else if (isa<ShuffleVectorInst>(&Inst)) {
+    return false;
   } else {
     return true;
   }
 }
 
-ConstantInt* ObfuscateZero::isValidCandidateOperand(Value *V) const {
-  if (ConstantInt *C = dyn_cast<ConstantInt>(V)) {
-    if (C->isZero()) {
+Constant* ObfuscateZero::isValidCandidateOperand(Value *V) const {
+  // Integer zeros and integer zeroinitializer vectors
+  Constant *C = dyn_cast<Constant>(V);
+  if (C && C->getType()->isIntOrIntVectorTy()) {
+    if (C->isNullValue()) {
       return C;
     } else {
       return nullptr;
@@ -83,8 +143,47 @@ ConstantInt* ObfuscateZero::isValidCandidateOperand(Value *V) const {
 }
 
 void ObfuscateZero::registerInteger(Value &V) {
-  if (V.getType()->isIntegerTy() && !dyn_cast<llvm::ConstantInt>(&V))
-    IntegerVect.push_back(&V);
+  if (V.getType()->isIntegerTy() && !dyn_cast<llvm::ConstantInt>(&V)){
+    // Reservoir sampling keeps a uniform sample of bounded size
+    IntegerSeen++;
+    if(IntegerVect.size() < MaxCandidates){
+      IntegerVect.push_back(&V);
+    }else{
+      std::uniform_int_distribution<size_t> Rand(0, IntegerSeen - 1);
+      size_t ix = Rand(Generator);
+      if(ix < IntegerVect.size())
+        IntegerVect[ix] = &V;
+    }
+  }
+}
+
+Value *ObfuscateZero::getZero(Instruction &Inst, Constant *VReplace) {
+  // Vector zeros are built as a scalar and splatted
+  Type *ty = VReplace->getType();
+  Value *zero = nullptr;
+  if(ZeroPoolSize == 0){
+    zero = replaceZero(Inst, cast<ConstantInt>(Constant::getNullValue(ty->getScalarType())));
+  }else{
+    if(ZeroPool.size() < ZeroPoolSize){
+      IntegerType *i32 = Type::getInt32Ty(Inst.getContext());
+      zero = replaceZero(Inst, ConstantInt::get(i32, 0));
+      if(zero)
+        ZeroPool.push_back(zero);
+    }
+    if(!zero && ZeroPool.size() > 0){
+      std::uniform_int_distribution<size_t> Rand(0, ZeroPool.size() - 1);
+      zero = ZeroPool[Rand(Generator)];
+    }
+    if(zero){
+      IRBuilder<> Builder(&Inst);
+      zero = Builder.CreateIntCast(zero, ty->getScalarType(), false);
+    }
+  }
+  if(zero && ty->isVectorTy()){
+    IRBuilder<> Builder(&Inst);
+    zero = Builder.CreateVectorSplat(ty->getVectorNumElements(), zero);
+  }
+  return zero;
 }
 
 Value *ObfuscateZero::createExpression(Value* x, const uint32_t p, IRBuilder<>& Builder) {
@@ -148,31 +247,16 @@ Value* ObfuscateZero::replaceZero(Instruction &Inst, ConstantInt *VReplace) {
           replaced = Builder.CreateSExt(comp, ReplacedType);
           break;
         }
-        case 1:{
-          // x + y = x^y + 2*(x&y)
-          replaced = Builder.CreateAdd(x,y);
-          temp = Builder.CreateXor(x,y);
-          replaced = Builder.CreateSub(replaced, temp);
-          temp = Builder.CreateAnd(x,y);
-          temp = Builder.CreateShl(temp, ConstantInt::get(i32, 1));
-          replaced = Builder.CreateXor(replaced, temp);
-          replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
-          break;
-        }
+        case 1:
         case 2:{
-          // x ^ y == (x|~y) - 3*(~(x|y)) + 2*(~x) - y
-          Value *a = Builder.CreateNot(y);
-          a = Builder.CreateOr(x, a);
-          Value *b = Builder.CreateOr(x,y);
-          b = Builder.CreateNot(b);
-          b = Builder.CreateMul(b, ConstantInt::get(i32, -3));
-          Value *c = Builder.CreateNot(x);
-          c = Builder.CreateMul(c, ConstantInt::get(i32, 2));
-          c = Builder.CreateSub(c, y);
-          replaced = Builder.CreateXor(x,y);
-          replaced = Builder.CreateSub(replaced, a);
-          replaced = Builder.CreateSub(replaced, b);
-          replaced = Builder.CreateXor(replaced, c);
+          // x op y == MBA(x op y)
+          std::vector<Instruction::BinaryOps> vecBin{BinaryOperator::Add, BinaryOperator::Sub,
+              BinaryOperator::And, BinaryOperator::Or, BinaryOperator::Xor};
+          std::uniform_int_distribution<size_t> randOp(0, vecBin.size() - 1);
+          Instruction::BinaryOps op = vecBin[randOp(Generator)];
+          replaced = Builder.CreateBinOp(op, x, y);
+          temp = createMBA(Builder, op, x, y, ZeroCost);
+          replaced = Builder.CreateXor(replaced, temp);
           replaced = Builder.CreateIntCast(replaced, ReplacedType, false);
           break;
         }
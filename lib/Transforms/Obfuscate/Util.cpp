@@ -1,9 +1,11 @@
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IRBuilder.h"
 
 #include "Util.h"
 
+#include <algorithm>
 #include <string>
 #include <random>
 
@@ -145,13 +147,221 @@ bool isPrime(uint32_t number){
   return true;
 }
 
+static Value *mbaOp(IRBuilder<> &B, Instruction::BinaryOps op, Value *x, Value *y, unsigned depth);
+
+namespace {
+// A mixed boolean-arithmetic identity for op, with its size in instructions
+// and its critical path in cycles
+struct MBAIdentity {
+  Instruction::BinaryOps op;
+  unsigned insts;
+  unsigned latency;
+  Value *(*build)(IRBuilder<> &B, Value *x, Value *y, unsigned depth);
+};
+}
+
+// x + x rather than x << 1, which is poison on i1
+static Value *mbaTwice(IRBuilder<> &B, Value *x){
+  return B.CreateAdd(x, x);
+}
+
+static const MBAIdentity mbaCatalog[] = {
+  // x + y == (x|y) + (x&y)
+  {Instruction::Add, 3, 2, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Add, mbaOp(B, Instruction::Or, x, y, d), mbaOp(B, Instruction::And, x, y, d), d);}},
+  // x + y == (x^y) + 2*(x&y)
+  {Instruction::Add, 4, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Add, mbaOp(B, Instruction::Xor, x, y, d), mbaTwice(B, mbaOp(B, Instruction::And, x, y, d)), d);}},
+  // x + y == 2*(x|y) - (x^y)
+  {Instruction::Add, 4, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Sub, mbaTwice(B, mbaOp(B, Instruction::Or, x, y, d)), mbaOp(B, Instruction::Xor, x, y, d), d);}},
+  // x + y == (x|~y) + (~x&y) - (~(x&y)) + (x|y)
+  {Instruction::Add, 10, 5, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaOp(B, Instruction::Or, B.CreateNot(y), x, d);
+    Value *b = mbaOp(B, Instruction::And, B.CreateNot(x), y, d);
+    Value *c = B.CreateNot(mbaOp(B, Instruction::And, x, y, d));
+    Value *r = mbaOp(B, Instruction::Add, a, b, d);
+    r = mbaOp(B, Instruction::Sub, r, c, d);
+    return mbaOp(B, Instruction::Add, r, mbaOp(B, Instruction::Or, x, y, d), d);}},
+  // x - y == x + ~y + 1
+  {Instruction::Sub, 3, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *r = mbaOp(B, Instruction::Add, x, B.CreateNot(y), d);
+    return mbaOp(B, Instruction::Add, r, ConstantInt::get(x->getType(), 1), d);}},
+  // x - y == (x^y) - 2*(~x&y)
+  {Instruction::Sub, 5, 4, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaTwice(B, mbaOp(B, Instruction::And, B.CreateNot(x), y, d));
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Xor, x, y, d), a, d);}},
+  // x - y == (x&~y) - (~x&y)
+  {Instruction::Sub, 5, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaOp(B, Instruction::And, x, B.CreateNot(y), d);
+    Value *b = mbaOp(B, Instruction::And, B.CreateNot(x), y, d);
+    return mbaOp(B, Instruction::Sub, a, b, d);}},
+  // x & y == (x+y) - (x|y)
+  {Instruction::And, 3, 2, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Add, x, y, d), mbaOp(B, Instruction::Or, x, y, d), d);}},
+  // x & y == (~x|y) - ~x
+  {Instruction::And, 3, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *nx = B.CreateNot(x);
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Or, nx, y, d), nx, d);}},
+  // x & y == -(~(x&y)) + (~x|y) + (x&~y)
+  {Instruction::And, 8, 4, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = B.CreateNot(mbaOp(B, Instruction::And, x, y, d));
+    Value *b = mbaOp(B, Instruction::Or, B.CreateNot(x), y, d);
+    Value *c = mbaOp(B, Instruction::And, x, B.CreateNot(y), d);
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Add, b, c, d), a, d);}},
+  // x | y == (x+y) - (x&y)
+  {Instruction::Or, 3, 2, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Add, x, y, d), mbaOp(B, Instruction::And, x, y, d), d);}},
+  // x | y == (x&~y) + y
+  {Instruction::Or, 3, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Add, mbaOp(B, Instruction::And, x, B.CreateNot(y), d), y, d);}},
+  // x | y == (x^y) + y - (~x&y)
+  {Instruction::Or, 5, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaOp(B, Instruction::Xor, x, y, d);
+    Value *b = mbaOp(B, Instruction::And, B.CreateNot(x), y, d);
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Add, a, y, d), b, d);}},
+  // x ^ y == (x|y) - (x&y)
+  {Instruction::Xor, 3, 2, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Or, x, y, d), mbaOp(B, Instruction::And, x, y, d), d);}},
+  // x ^ y == x + y - 2*(x&y)
+  {Instruction::Xor, 4, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaTwice(B, mbaOp(B, Instruction::And, x, y, d));
+    return mbaOp(B, Instruction::Sub, mbaOp(B, Instruction::Add, x, y, d), a, d);}},
+  // x ^ y == (x&~y) + (~x&y)
+  {Instruction::Xor, 5, 3, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaOp(B, Instruction::And, x, B.CreateNot(y), d);
+    Value *b = mbaOp(B, Instruction::And, B.CreateNot(x), y, d);
+    return mbaOp(B, Instruction::Add, a, b, d);}},
+  // x ^ y == (x|~y) - 3*(~(x|y)) + 2*(~x) - y
+  {Instruction::Xor, 10, 8, [](IRBuilder<> &B, Value *x, Value *y, unsigned d) -> Value *{
+    Value *a = mbaOp(B, Instruction::Or, x, B.CreateNot(y), d);
+    Value *b = B.CreateMul(B.CreateNot(mbaOp(B, Instruction::Or, x, y, d)),
+                           ConstantInt::get(x->getType(), 3));
+    Value *c = mbaTwice(B, B.CreateNot(x));
+    Value *r = mbaOp(B, Instruction::Sub, a, b, d);
+    r = mbaOp(B, Instruction::Add, r, c, d);
+    return mbaOp(B, Instruction::Sub, r, y, d);}},
+};
+
+static Value *rewriteMBA(IRBuilder<> &B, Instruction::BinaryOps op, Value *x, Value *y,
+                         unsigned maxInsts, unsigned maxLatency, unsigned depth){
+  std::vector<const MBAIdentity *> candidates;
+  for(const MBAIdentity &id: mbaCatalog){
+    if(id.op == op && id.insts <= maxInsts && id.latency <= maxLatency)
+      candidates.push_back(&id);
+  }
+  if(candidates.empty())
+    return B.CreateBinOp(op, x, y);
+  std::uniform_int_distribution<size_t> rand(0, candidates.size() - 1);
+  return candidates[rand(getRandomEngine())]->build(B, x, y, depth);
+}
+
+// Operators inside an identity are rewritten again until depth runs out
+static Value *mbaOp(IRBuilder<> &B, Instruction::BinaryOps op, Value *x, Value *y, unsigned depth){
+  if(depth == 0)
+    return B.CreateBinOp(op, x, y);
+  return rewriteMBA(B, op, x, y, UINT_MAX, UINT_MAX, depth - 1);
+}
+
+Value *createMBA(IRBuilder<> &Builder, Instruction::BinaryOps op, Value *x, Value *y, MBACost cost){
+  switch(cost){
+    case MBACheap:
+      return rewriteMBA(Builder, op, x, y, 3, 3, 0);
+    case MBAMedium:
+      return rewriteMBA(Builder, op, x, y, UINT_MAX, 4, 0);
+    case MBAHeavy:
+      return rewriteMBA(Builder, op, x, y, UINT_MAX, UINT_MAX, 1);
+  }
+  return Builder.CreateBinOp(op, x, y);
+}
+
+std::mt19937 &getRandomEngine(){
+  static std::mt19937 g{std::random_device{}()};
+  return g;
+}
+
+// All primes in [2^8, 2^16], sieved once on first use
+const uint32_t primeTableMin = 1 << 8;
+const uint32_t primeTableMax = 1 << 16;
+
+static const std::vector<uint32_t> &primeTable(){
+  static const std::vector<uint32_t> table = []{
+    std::vector<bool> composite(primeTableMax + 1, false);
+    std::vector<uint32_t> primes;
+    for(uint64_t i = 2; i <= primeTableMax; i++){
+      if(composite[i])
+        continue;
+      if(i >= primeTableMin)
+        primes.push_back(i);
+      for(uint64_t j = i*i; j <= primeTableMax; j += i)
+        composite[j] = true;
+    }
+    return primes;
+  }();
+  return table;
+}
+
 uint32_t randPrime(uint32_t min, uint32_t max){
-  std::random_device rd;
-  std::mt19937 g(rd());
+  std::mt19937 &g = getRandomEngine();
+  if(min >= primeTableMin && max <= primeTableMax){
+    const std::vector<uint32_t> &table = primeTable();
+    auto lo = std::lower_bound(table.begin(), table.end(), min);
+    auto hi = std::upper_bound(table.begin(), table.end(), max);
+    if(lo != hi){
+      std::uniform_int_distribution<size_t> rand(0, std::distance(lo, hi) - 1);
+      return lo[rand(g)];
+    }
+  }
+
   std::uniform_int_distribution<uint32_t> rand(min, max);
   uint32_t p = rand(g);
   while(!isPrime(p)){
     p = rand(g);
   }
   return p;
+}
+
+static bool originHas(const MDNode *N, StringRef pass){
+  if(!N)
+    return false;
+  for(const MDOperand &op: N->operands()){
+    MDString *S = dyn_cast<MDString>(op);
+    if(S && S->getString() == pass)
+      return true;
+  }
+  return false;
+}
+
+void setOrigin(Instruction *I, StringRef pass){
+  LLVMContext &C = I->getContext();
+  I->setMetadata("obf.origin", MDNode::get(C, MDString::get(C, pass)));
+}
+
+void setOrigin(BasicBlock *BB, StringRef pass){
+  if(Instruction *T = BB->getTerminator())
+    setOrigin(T, pass);
+}
+
+void addOrigin(Function *F, StringRef pass){
+  MDNode *N = F->getMetadata("obf.origin");
+  if(originHas(N, pass))
+    return;
+  std::vector<Metadata *> ops;
+  if(N)
+    ops.insert(ops.end(), N->op_begin(), N->op_end());
+  ops.push_back(MDString::get(F->getContext(), pass));
+  F->setMetadata("obf.origin", MDNode::get(F->getContext(), ops));
+}
+
+bool hasOrigin(const Instruction *I, StringRef pass){
+  return originHas(I->getMetadata("obf.origin"), pass);
+}
+
+bool hasOrigin(const BasicBlock *BB, StringRef pass){
+  const Instruction *T = BB->getTerminator();
+  return T && hasOrigin(T, pass);
+}
+
+bool hasOrigin(const Function *F, StringRef pass){
+  return originHas(F->getMetadata("obf.origin"), pass);
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IRBuilder.h"
+
+#include <random>
 
 void fixStack(llvm::Function *f);
 
@@ -7,4 +10,24 @@ const uint32_t fnvPrime = 19260817;
 const uint32_t fnvBasis = 0x114514;
 uint32_t fnvHash(const uint32_t data, uint32_t b);
 llvm::InlineAsm *generateGarbage(llvm::Function *f);
-uint32_t randPrime(uint32_t min, uint32_t max);
\ No newline at end of file
+std::mt19937 &getRandomEngine();
+
+// Strength of a mixed boolean-arithmetic rewrite: cheap identities add 1-2
+// instructions, medium ones keep the critical path within 4 cycles, heavy
+// ones have no bound and also rewrite the operators inside the identity
+enum MBACost { MBACheap, MBAMedium, MBAHeavy };
+llvm::Value *createMBA(llvm::IRBuilder<> &Builder, llvm::Instruction::BinaryOps op,
+                       llvm::Value *x, llvm::Value *y, MBACost cost);
+uint32_t randPrime(uint32_t min, uint32_t max);
+// Provenance of generated code, kept in !obf.origin. Instructions carry the
+// pass that generated them, blocks the origin of their terminator, functions
+// every pass that created or already transformed them. Passes skip their own
+// output so running them again does not compound.
+void setOrigin(llvm::Instruction *I, llvm::StringRef pass);
+void setOrigin(llvm::BasicBlock *BB, llvm::StringRef pass);
+void addOrigin(llvm::Function *F, llvm::StringRef pass);
+bool hasOrigin(const llvm::Instruction *I, llvm::StringRef pass);
+bool hasOrigin(const llvm::BasicBlock *BB, llvm::StringRef pass);
+bool hasOrigin(const llvm::Function *F, llvm::StringRef pass);
+// Compiles the functions annotated with "vm" to bytecode, see VMBytecode.cpp
+bool virtualizeBytecode(llvm::Module &M);
\ No newline at end of file
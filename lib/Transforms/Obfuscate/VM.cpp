@@ -1,4 +1,6 @@
 #include "llvm/Pass.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
@@ -6,12 +8,60 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
 
+#include "Util.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
 #include <vector>
 #include <random>
 
 using namespace llvm;
 
+static cl::opt<MBACost> VMCost("vm-mba", cl::init(MBAMedium),
+    cl::desc("Strength of the MBA identities inside the VM helpers"),
+    cl::values(clEnumValN(MBACheap, "cheap", "1-2 extra instructions"),
+               clEnumValN(MBAMedium, "medium", "One identity of at most 4 cycles per operator"),
+               clEnumValN(MBAHeavy, "heavy", "Nested identities")));
+
+static cl::opt<bool> VMInline("vm-inline", cl::init(false),
+    cl::desc("Expand MBA identities at the use site in the native width "
+             "instead of calling VM helpers"));
+
+static cl::opt<unsigned> VMDensity("vm-density", cl::init(100),
+    cl::desc("Percentage of the operators substituted in each function "
+             "(overridden by the \"vm-density\" function attribute)"));
+
+static cl::opt<unsigned> VMSpecialize("vm-specialize", cl::init(32),
+    cl::desc("Maximum number of helpers per module specialized for a "
+             "constant operand (shift amounts, masks, addends)"));
+
+static cl::opt<bool> VMFuse("vm-fuse", cl::init(false),
+    cl::desc("Substitute each single-use tree of operators in a block with "
+             "one helper call"));
+
+static cl::opt<unsigned> VMFuseArgs("vm-fuse-args", cl::init(6),
+    cl::desc("Maximum number of arguments of a fused helper"));
+
+enum HelperLinkage { HelperInternal, HelperShared };
+static cl::opt<HelperLinkage> VMLinkage("vm-linkage", cl::init(HelperInternal),
+    cl::desc("Linkage of the VM helpers"),
+    cl::values(clEnumValN(HelperInternal, "internal",
+                          "Private copy with diversified identities in every module"),
+               clEnumValN(HelperShared, "shared",
+                          "linkonce_odr in a COMDAT, the linker keeps one copy")));
+
+static cl::opt<std::string> VMSeed("vm-seed", cl::init(""),
+    cl::desc("Build seed of the shared helpers, mixed into their names and "
+             "identities"));
+
+static cl::opt<bool> VMBytecode("vm-bytecode", cl::init(false),
+    cl::desc("Compile functions annotated with \"vm\" (or carrying the "
+             "\"vm-bytecode\" attribute) to bytecode run by an interpreter"));
+
 namespace {
   struct Virtualize : public ModulePass {
     static char ID;
@@ -20,185 +70,266 @@ namespace {
     bool runOnModule(Module &M) override;
 
     private:
-    Function *Add = nullptr;
-    Function *CreateAdd(FunctionType *funcTy, Module &M);
-    Function *Sub = nullptr;
-    Function *CreateSub(FunctionType *funcTy, Module &M);
-    Function *Shl = nullptr;
-    Function *CreateShl(FunctionType *funcTy, Module &M);
-    Function *AShr = nullptr;
-    Function *CreateAShr(FunctionType *funcTy, Module &M);
-    Function *LShr = nullptr;
-    Function *CreateLShr(FunctionType *funcTy, Module &M);
-    Function *And = nullptr;
-    Function *CreateAnd(FunctionType *funcTy, Module &M);
-    Function *Or = nullptr;
-    Function *CreateOr(FunctionType *funcTy, Module &M);
-    Function *Xor = nullptr;
-    Function *CreateXor(FunctionType *funcTy, Module &M);
+    // One helper per opcode, operand type and optional constant operand
+    std::map<std::tuple<unsigned, Type *, Constant *>, Function *> helpers;
+    unsigned numSpecialized = 0;
+    Function *getHelper(Instruction::BinaryOps op, Type *ty, Module &M,
+                        Constant *C = nullptr);
+    Function *CreateHelper(Instruction::BinaryOps op, Type *ty, Constant *C, Module &M);
+    Function *declareHelper(FunctionType *funcTy, std::string name, Module &M);
+
+    // Fused helpers, deduplicated by tree shape and type
+    std::map<std::pair<std::string, Type *>, Function *> fused;
+    void collectTree(BinaryOperator *I, std::set<BinaryOperator *> &candidates,
+                     std::vector<BinaryOperator *> &nodes, std::vector<Value *> &leaves,
+                     std::string &shape);
+    Value *emitTree(IRBuilder<> &Builder, Value *V, std::set<BinaryOperator *> &nodes,
+                    Function::arg_iterator &itArgs);
+    bool fuseTree(BinaryOperator *root, std::set<BinaryOperator *> &candidates, Module &M);
   };
 }
 
 char Virtualize::ID = 0;
 static RegisterPass<Virtualize> X("vm", "Use functions to do simple arithmetic");
 
-Function *Virtualize::CreateAdd(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Add", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  //BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Add, x, y, "", entry);
-  //x + y == (x|~y) + (~x&y) - (~(x&y)) + (x|y)
-  Value *a = Builder.CreateNot(y);
-  a = Builder.CreateOr(a,x);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateAnd(b,y);
-  Value *c = Builder.CreateAnd(x,y);
-  c = Builder.CreateNot(c);
-  Value *d = Builder.CreateOr(x,y);
-  Value *binOp = Builder.CreateAdd(a,b);
-  binOp = Builder.CreateSub(binOp, c);
-  binOp = Builder.CreateAdd(binOp, d);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+static std::string typeSuffix(Type *ty){
+  std::string name = ty->isVectorTy() ? ".v" + std::to_string(ty->getVectorNumElements()) : ".";
+  return name + "i" + std::to_string(ty->getScalarSizeInBits());
 }
 
-Function *Virtualize::CreateSub(FunctionType *funcTy, Module &M){
-  if(!Virtualize::Add)
-    Virtualize::Add = CreateAdd(funcTy, M);
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Sub", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  //BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Sub, x, y, "", entry);
-  // x - y == x + ~y + 1
-  Value *ny = Builder.CreateNot(y);
-  std::vector<Value *> callArgs;
-  callArgs.push_back(x);
-  callArgs.push_back(ny);
-  Value *binOp = CallInst::Create(Virtualize::Add, callArgs, "", entry);
-  binOp = Builder.CreateAdd(binOp, ConstantInt::get(
-                            cast<IntegerType>(x->getType()), 1));
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+static std::string helperName(Instruction::BinaryOps op, Type *ty){
+  std::string name = "__YANSOLLVM_VM_";
+  switch(op){
+    case BinaryOperator::Add: name += "Add"; break;
+    case BinaryOperator::Sub: name += "Sub"; break;
+    case BinaryOperator::Shl: name += "Shl"; break;
+    case BinaryOperator::AShr: name += "AShr"; break;
+    case BinaryOperator::LShr: name += "LShr"; break;
+    case BinaryOperator::And: name += "And"; break;
+    case BinaryOperator::Or: name += "Or"; break;
+    case BinaryOperator::Xor: name += "Xor"; break;
+    default: name += Instruction::getOpcodeName(op); break;
+  }
+  return name + typeSuffix(ty);
 }
 
-Function *Virtualize::CreateShl(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Shl", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Shl, x, y, "", entry);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
+Function *Virtualize::getHelper(Instruction::BinaryOps op, Type *ty, Module &M,
+                               Constant *C){
+  auto key = std::make_tuple((unsigned)op, ty, C);
+  auto found = helpers.find(key);
+  if(found != helpers.end())
+    return found->second;
+  if(C){
+    if(numSpecialized >= VMSpecialize)
+      return nullptr;
+    numSpecialized++;
+  }
+  Function *f = CreateHelper(op, ty, C, M);
+  helpers[key] = f;
   return f;
 }
 
-Function *Virtualize::CreateAShr(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_AShr", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::AShr, x, y, "", entry);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+static uint32_t hashName(StringRef name, uint32_t h){
+  for(char c: name)
+    h = fnvHash((unsigned char)c, h);
+  return h;
 }
 
-Function *Virtualize::CreateLShr(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_LShr", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::LShr, x, y, "", entry);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
+// Shared helpers are named after the build seed and the MBA strength, and
+// their body only depends on that name, so every module emits the same
+// definition. Returns an existing definition as is.
+Function *Virtualize::declareHelper(FunctionType *funcTy, std::string name, Module &M){
+  Function *f;
+  if(VMLinkage == HelperInternal){
+    f = Function::Create(funcTy, GlobalValue::InternalLinkage, name, M);
+    addOrigin(f, "vm");
+    return f;
+  }
+  name += "." + utohexstr(hashName(VMSeed, fnvHash(VMCost, fnvBasis)));
+  f = M.getFunction(name);
+  if(f && f->getFunctionType() == funcTy)
+    return f;
+  f = Function::Create(funcTy, GlobalValue::LinkOnceODRLinkage, name, M);
+  addOrigin(f, "vm");
+  f->setVisibility(GlobalValue::HiddenVisibility);
+  if(Triple(M.getTargetTriple()).supportsCOMDAT())
+    f->setComdat(M.getOrInsertComdat(f->getName()));
   return f;
 }
 
-Function *Virtualize::CreateAnd(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_And", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
+// With C the helper takes x only and has C baked in as its second operand
+Function *Virtualize::CreateHelper(Instruction::BinaryOps op, Type *ty, Constant *C, Module &M){
+  std::vector<Type *> paramTy(C ? 1 : 2, ty);
+  FunctionType *funcTy = FunctionType::get(ty, paramTy, false);
+  std::string name = helperName(op, ty);
+  if(C)
+    name += ".k" + utohexstr(C->getUniqueInteger().getZExtValue());
+  Function *f = declareHelper(funcTy, name, M);
+  if(!f->empty())
+    return f;
+  std::mt19937 &g = getRandomEngine();
+  std::mt19937 saved = g;
+  if(VMLinkage == HelperShared)
+    g.seed(hashName(f->getName(), fnvBasis));
+  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs;
+  Value *y = C ? (Value *)C : (Value *)++itArgs;
   BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
   IRBuilder<> Builder(entry);
-  //BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::And, x, y, "", entry);
-  //x & y == -(~(x&y)) + (~x|y) + (x&~y)
-  Value *a = Builder.CreateAnd(x,y);
-  a = Builder.CreateNot(a);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateOr(b,y);
-  Value *c = Builder.CreateNot(y);
-  c = Builder.CreateAnd(x,c);
-  Value *binOp = Builder.CreateAdd(b,c);
-  binOp = Builder.CreateSub(binOp, a);
+  Value *binOp = nullptr;
+  switch(op){
+    case BinaryOperator::Sub:{
+      if(C){
+        binOp = createMBA(Builder, op, x, y, VMCost);
+        break;
+      }
+      // x - y == x + ~y + 1
+      Value *ny = Builder.CreateNot(y);
+      binOp = Builder.CreateCall(getHelper(BinaryOperator::Add, ty, M), {x, ny});
+      binOp = Builder.CreateAdd(binOp, ConstantInt::get(ty, 1));
+      break;
+    }
+    case BinaryOperator::Shl:
+    case BinaryOperator::AShr:
+    case BinaryOperator::LShr:
+      binOp = Builder.CreateBinOp(op, x, y);
+      break;
+    default:
+      binOp = createMBA(Builder, op, x, y, VMCost);
+      break;
+  }
   ReturnInst::Create(M.getContext(), binOp, entry);
   f->addFnAttr(Attribute::NoInline);
   f->addFnAttr(Attribute::OptimizeNone);
+  g = saved;
   return f;
 }
 
-Function *Virtualize::CreateOr(FunctionType *funcTy, Module &M){
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Or", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  //BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Or, x, y, "", entry);
-  //x | y == (x^y) + y - (~x&y)
-  Value *a = Builder.CreateXor(x,y);
-  Value *b = Builder.CreateNot(x);
-  b = Builder.CreateAnd(b,y);
-  Value *binOp = Builder.CreateAdd(a,y);
-  binOp = Builder.CreateSub(binOp, b);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+// Operands that are themselves candidates with a single use in the same
+// block become part of the tree, everything else is passed as an argument
+void Virtualize::collectTree(BinaryOperator *I, std::set<BinaryOperator *> &candidates,
+                             std::vector<BinaryOperator *> &nodes, std::vector<Value *> &leaves,
+                             std::string &shape){
+  nodes.push_back(I);
+  shape += Instruction::getOpcodeName(I->getOpcode());
+  shape += "(";
+  for(Value *op: I->operands()){
+    BinaryOperator *B = dyn_cast<BinaryOperator>(op);
+    if(B && candidates.count(B) && B->hasOneUse() && B->getParent() == I->getParent()
+         && B->getType() == I->getType() && nodes.size() + 1 < VMFuseArgs){
+      collectTree(B, candidates, nodes, leaves, shape);
+    }else{
+      leaves.push_back(op);
+      shape += "$";
+    }
+    shape += ",";
+  }
+  shape += ")";
 }
 
-Function *Virtualize::CreateXor(FunctionType *funcTy, Module &M){
-  if(!Virtualize::Shl)
-    Virtualize::Shl = CreateShl(funcTy, M);
-  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Xor", M);
-  Function::arg_iterator itArgs = f->arg_begin(); Value *x = itArgs; Value *y = ++itArgs;
-  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
-  IRBuilder<> Builder(entry);
-  //BinaryOperator *binOp = BinaryOperator::Create(BinaryOperator::Xor, x, y, "", entry);
-  //x ^ y == x + y - ((x&y)<<1)
-  Value *a = Builder.CreateAdd(x,y);
-  Value *b = Builder.CreateAnd(x,y);
-  std::vector<Value *> callArgs;
-  callArgs.push_back(b);
-  callArgs.push_back(ConstantInt::get(cast<IntegerType>(x->getType()), 1));
-  Value *binOp = CallInst::Create(Virtualize::Shl, callArgs, "", entry);
-  binOp = Builder.CreateSub(a, binOp);
-  ReturnInst::Create(M.getContext(), binOp, entry);
-  f->addFnAttr(Attribute::NoInline);
-  f->addFnAttr(Attribute::OptimizeNone);
-  return f;
+Value *Virtualize::emitTree(IRBuilder<> &Builder, Value *V, std::set<BinaryOperator *> &nodes,
+                            Function::arg_iterator &itArgs){
+  BinaryOperator *I = dyn_cast<BinaryOperator>(V);
+  if(!I || !nodes.count(I))
+    return &*itArgs++;
+  Value *x = emitTree(Builder, I->getOperand(0), nodes, itArgs);
+  Value *y = emitTree(Builder, I->getOperand(1), nodes, itArgs);
+  switch(I->getOpcode()){
+    case BinaryOperator::Shl:
+    case BinaryOperator::AShr:
+    case BinaryOperator::LShr:
+      return Builder.CreateBinOp(I->getOpcode(), x, y);
+    default:
+      return createMBA(Builder, I->getOpcode(), x, y, VMCost);
+  }
+}
+
+// Replace the tree rooted at root with one call, returns false if the tree
+// is a single operator
+bool Virtualize::fuseTree(BinaryOperator *root, std::set<BinaryOperator *> &candidates, Module &M){
+  std::vector<BinaryOperator *> nodes;
+  std::vector<Value *> leaves;
+  std::string shape;
+  collectTree(root, candidates, nodes, leaves, shape);
+  if(nodes.size() < 2)
+    return false;
+
+  Type *ty = root->getType();
+  Function *&f = fused[std::make_pair(shape, ty)];
+  if(!f){
+    std::vector<Type *> paramTy;
+    for(Value *leaf: leaves)
+      paramTy.push_back(leaf->getType());
+    FunctionType *funcTy = FunctionType::get(ty, paramTy, false);
+    // Two hashes of the shape keep distinct trees from sharing an ODR name
+    uint64_t shapeHash = (uint64_t)hashName(shape, fnvBasis) << 32 | hashName(shape, fnvPrime);
+    f = declareHelper(funcTy, "__YANSOLLVM_VM_Fused." + utohexstr(shapeHash) + typeSuffix(ty), M);
+  }
+  if(f->empty()){
+    std::mt19937 &g = getRandomEngine();
+    std::mt19937 saved = g;
+    if(VMLinkage == HelperShared)
+      g.seed(hashName(f->getName(), fnvBasis));
+    BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", f);
+    IRBuilder<> Builder(entry);
+    std::set<BinaryOperator *> nodeSet(nodes.begin(), nodes.end());
+    Function::arg_iterator itArgs = f->arg_begin();
+    Value *binOp = emitTree(Builder, root, nodeSet, itArgs);
+    ReturnInst::Create(M.getContext(), binOp, entry);
+    f->addFnAttr(Attribute::NoInline);
+    f->addFnAttr(Attribute::OptimizeNone);
+    g = saved;
+  }
+
+  Value *replaced = CallInst::Create(f, leaves, "", root);
+  root->replaceAllUsesWith(replaced);
+  // Each node is only used by its parent, so erase parents first
+  for(BinaryOperator *I: nodes){
+    candidates.erase(I);
+    I->eraseFromParent();
+  }
+  return true;
 }
 
 bool Virtualize::runOnModule(Module &M){
   bool modified = false;
-  IntegerType *i64 = IntegerType::get(M.getContext(), 64);
-  std::vector<Type *> paramTy = {i64, i64};
-  FunctionType *funcTy = FunctionType::get(i64, paramTy, false);
   std::vector<BinaryOperator *> binOpIns;
+  helpers.clear();
+  fused.clear();
+  numSpecialized = 0;
+  std::mt19937 &g = getRandomEngine();
+  std::uniform_int_distribution<unsigned> rand(0, 99);
+  if(VMBytecode)
+    modified |= virtualizeBytecode(M);
   for(Function &F: M){
+    // Never substitute inside the helpers, the interpreter and the bytecode
+    // wrappers, including those linked in from other modules
+    if(hasOrigin(&F, "vm") || F.getName().startswith("__YANSOLLVM_VM_"))
+      continue;
+    unsigned density = VMDensity;
+    if(F.hasFnAttribute("vm-density"))
+      F.getFnAttribute("vm-density").getValueAsString().getAsInteger(10, density);
     for(inst_iterator I = inst_begin(&F), E = inst_end(&F); I != E; ++I){
       if(BinaryOperator *II = dyn_cast<BinaryOperator>(&*I)){
-        IntegerType *opType = cast<IntegerType>(II->getOperand(0)->getType());
-        if(opType->getBitWidth() > 64)
+        // Identities expanded by an earlier run are not expanded again
+        if(hasOrigin(II, "vm"))
+          continue;
+        // Integer vectors are handled lane-wise by the same identities
+        Type *opType = II->getType();
+        if(!opType->isIntOrIntVectorTy() || opType->getScalarSizeInBits() > 64)
           continue; 
+        if(rand(g) >= density)
+          continue;
         switch(II->getOpcode()){
-          case BinaryOperator::Add:
-          case BinaryOperator::Sub:
           case BinaryOperator::Shl:
           case BinaryOperator::AShr:
           case BinaryOperator::LShr:
+            // Shifts have no identity to expand inline
+            if(VMInline)
+              break;
+            binOpIns.push_back(II);
+            break;
+          case BinaryOperator::Add:
+          case BinaryOperator::Sub:
           case BinaryOperator::And:
           case BinaryOperator::Or:
           case BinaryOperator::Xor:
@@ -210,75 +341,54 @@ bool Virtualize::runOnModule(Module &M){
       }
     }
   }
-  for(BinaryOperator *II: binOpIns){
-    IntegerType *opType = cast<IntegerType>(II->getOperand(0)->getType());
-    Function *func = nullptr;
-    bool isSigned = false;
-    switch(II->getOpcode()){
-      case BinaryOperator::Add:{
-        if(!Virtualize::Add)
-          Virtualize::Add = CreateAdd(funcTy, M);
-        func = Virtualize::Add;
-        break;
-      }
-      case BinaryOperator::Sub:{
-        if(!Virtualize::Sub)
-          Virtualize::Sub = CreateSub(funcTy, M);
-        func = Virtualize::Sub;
-        break;
-      }
-      case BinaryOperator::Shl:{
-        if(!Virtualize::Shl)
-          Virtualize::Shl = CreateShl(funcTy, M);
-        func = Virtualize::Shl;
-        break;
-      }
-      case BinaryOperator::AShr:{
-        if(!Virtualize::AShr)
-          Virtualize::AShr = CreateAShr(funcTy, M);
-        func = Virtualize::AShr;
-        isSigned  = true;
-        break;
-      }
-      case BinaryOperator::LShr:{
-        if(!Virtualize::LShr)
-          Virtualize::LShr = CreateLShr(funcTy, M);
-        func = Virtualize::LShr;
-        break;
-      }
-      case BinaryOperator::And:{
-        if(!Virtualize::And)
-          Virtualize::And = CreateAnd(funcTy, M);
-        func = Virtualize::And;
-        break;
-      }
-      case BinaryOperator::Or:{
-        if(!Virtualize::Or)
-          Virtualize::Or = CreateOr(funcTy, M);
-        func = Virtualize::Or;
-        break;
-      }
-      case BinaryOperator::Xor:{
-        if(!Virtualize::Xor)
-          Virtualize::Xor = CreateXor(funcTy, M);
-        func = Virtualize::Xor;
-        break;
-      }
-      default:
-        break;
+  if(VMFuse && !VMInline){
+    // Users come after their operands, so walking backwards visits the
+    // root of each tree before its nodes
+    std::set<BinaryOperator *> candidates(binOpIns.begin(), binOpIns.end());
+    for(auto it = binOpIns.rbegin(); it != binOpIns.rend(); ++it){
+      if(candidates.count(*it) && fuseTree(*it, candidates, M))
+        modified = true;
+    }
+    std::vector<BinaryOperator *> rest;
+    for(BinaryOperator *II: binOpIns){
+      if(candidates.count(II))
+        rest.push_back(II);
     }
-    if(func){
-      std::vector<Value*> callArgs;
-      callArgs.push_back(CastInst::CreateIntegerCast(
-                         II->getOperand(0), i64, isSigned, "", II));
-      callArgs.push_back(CastInst::CreateIntegerCast(
-                         II->getOperand(1), i64, isSigned, "", II));
-      Value *replaced = CallInst::Create(func, callArgs, "", II);
-      replaced = CastInst::CreateIntegerCast(replaced, opType, false, "", II);
+    binOpIns.swap(rest);
+  }
+  for(BinaryOperator *II: binOpIns){
+    Type *opType = II->getType();
+    if(VMInline){
+      IRBuilder<> Builder(II);
+      Instruction *prev = II->getPrevNode();
+      Value *replaced = createMBA(Builder, II->getOpcode(),
+                                  II->getOperand(0), II->getOperand(1), VMCost);
+      for(Instruction *New = prev ? prev->getNextNode() : &II->getParent()->front();
+          New != II; New = New->getNextNode())
+        setOrigin(New, "vm");
       II->replaceAllUsesWith(replaced);
       II->eraseFromParent();
       modified = true;
+      continue;
+    }
+    Value *x = II->getOperand(0), *y = II->getOperand(1);
+    if(II->isCommutative() && isa<Constant>(x))
+      std::swap(x, y);
+    // Constant integers and splats get a helper with the constant baked in
+    Constant *C = dyn_cast<Constant>(y);
+    if(C && !isa<ConstantInt>(C) && !(C->getType()->isVectorTy() && isa_and_nonnull<ConstantInt>(C->getSplatValue())))
+      C = nullptr;
+    Function *func = C ? getHelper(II->getOpcode(), opType, M, C) : nullptr;
+    std::vector<Value*> callArgs;
+    callArgs.push_back(x);
+    if(!func){
+      func = getHelper(II->getOpcode(), opType, M);
+      callArgs.push_back(y);
     }
+    Value *replaced = CallInst::Create(func, callArgs, "", II);
+    II->replaceAllUsesWith(replaced);
+    II->eraseFromParent();
+    modified = true;
   }
   return modified;
 }
\ No newline at end of file
@@ -0,0 +1,676 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+#include "Util.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+// Register based bytecode. Every instruction takes one 8-byte slot:
+//   byte 0     opcode, permuted per build
+//   byte 1     sh = 64 - bit width of the operation
+//   byte 2..5  dst, a, b, c registers
+//   byte 4..7  branch targets, two 16-bit slot indices
+// Compare & branch superinstructions keep their operands in bytes 2 and 3.
+// LI is followed by a slot holding the 64-bit immediate.
+// Registers are i64 and always hold the value zero-extended from its width.
+namespace {
+enum BCOp {
+  BC_Add, BC_Sub, BC_Mul, BC_UDiv, BC_SDiv, BC_URem, BC_SRem,
+  BC_Shl, BC_LShr, BC_AShr, BC_And, BC_Or, BC_Xor,
+  BC_ICmp,                 // + predicate - ICMP_EQ
+  BC_CmpBr = BC_ICmp + 10, // + predicate - ICMP_EQ
+  BC_Select = BC_CmpBr + 10,
+  BC_Mov, BC_Li, BC_Mask, BC_SExt, BC_Br, BC_CBr, BC_Ret,
+  BC_Load,                 // + log2 of the size in bytes
+  BC_Store = BC_Load + 4,  // + log2 of the size in bytes
+  BC_Num = BC_Store + 4
+};
+
+const unsigned maxRegs = 256;
+
+class BytecodeCompiler {
+  public:
+  BytecodeCompiler(Function &F, const std::vector<uint8_t> &perm)
+      : F(F), DL(F.getParent()->getDataLayout()), perm(perm) {}
+
+  bool compile();
+  void replaceBody(Function *interp);
+
+  private:
+  Function &F;
+  const DataLayout &DL;
+  const std::vector<uint8_t> &perm;
+  std::map<Value *, unsigned> regs;
+  std::map<PHINode *, unsigned> phiTemps;
+  std::set<ICmpInst *> fusedCmp;
+  // Values computed by the wrapper: arguments, static allocas, globals
+  std::vector<Value *> liveIns;
+  std::vector<std::pair<Constant *, uint64_t>> imms;
+  unsigned numRegs = 0;
+  unsigned scratch = 0;
+  std::vector<uint8_t> code;
+  std::map<BasicBlock *, unsigned> blockSlot;
+  std::vector<std::pair<size_t, BasicBlock *>> fixups;
+
+  bool isSupportedType(Type *ty) const;
+  bool isSupported(Instruction &I) const;
+  unsigned shiftOf(Type *ty) const;
+  unsigned addReg(Value *V);
+  unsigned reg(Value *V) { return regs[V]; }
+  size_t emit(unsigned op, unsigned sh, unsigned dst, unsigned a, unsigned b, unsigned c);
+  void emitImm(unsigned dst, uint64_t v);
+  void put16(size_t at, unsigned v);
+  void emitPhiMoves(BasicBlock *P, BasicBlock *S);
+  void emitTarget(size_t at, BasicBlock *P, BasicBlock *S);
+  void emitGEP(GetElementPtrInst *GEP);
+  void emitInst(Instruction &I);
+};
+} // namespace
+
+bool BytecodeCompiler::isSupportedType(Type *ty) const {
+  if(ty->isPointerTy())
+    return DL.getPointerSizeInBits(ty->getPointerAddressSpace()) <= 64;
+  return ty->isIntegerTy() && ty->getIntegerBitWidth() <= 64;
+}
+
+bool BytecodeCompiler::isSupported(Instruction &I) const {
+  if(isa<DbgInfoIntrinsic>(&I))
+    return true;
+  if(IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I))
+    return II->getIntrinsicID() == Intrinsic::lifetime_start ||
+           II->getIntrinsicID() == Intrinsic::lifetime_end;
+  if(AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+    return AI->isStaticAlloca() && AI->getParent() == &F.getEntryBlock();
+  if(isa<BranchInst>(&I) || isa<UnreachableInst>(&I))
+    return true;
+  if(isa<ReturnInst>(&I))
+    return I.getNumOperands() == 0 || isSupportedType(I.getOperand(0)->getType());
+  if(LoadInst *LI = dyn_cast<LoadInst>(&I)){
+    Type *ty = LI->getType();
+    uint64_t size = DL.getTypeStoreSize(ty);
+    return LI->isSimple() && isSupportedType(ty) && (size & (size - 1)) == 0 &&
+           (DL.getTypeSizeInBits(ty) == size * 8 || ty->isIntegerTy(1));
+  }
+  if(StoreInst *SI = dyn_cast<StoreInst>(&I)){
+    Type *ty = SI->getValueOperand()->getType();
+    uint64_t size = DL.getTypeStoreSize(ty);
+    return SI->isSimple() && isSupportedType(ty) && (size & (size - 1)) == 0 &&
+           (DL.getTypeSizeInBits(ty) == size * 8 || ty->isIntegerTy(1));
+  }
+  if(GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I))
+    return isSupportedType(GEP->getType());
+  if(ICmpInst *IC = dyn_cast<ICmpInst>(&I))
+    return isSupportedType(IC->getOperand(0)->getType());
+  if(isa<BinaryOperator>(&I) || isa<SelectInst>(&I) || isa<PHINode>(&I) ||
+     isa<ZExtInst>(&I) || isa<SExtInst>(&I) || isa<TruncInst>(&I) ||
+     isa<PtrToIntInst>(&I) || isa<IntToPtrInst>(&I) || isa<BitCastInst>(&I)){
+    if(!isSupportedType(I.getType()))
+      return false;
+    switch(I.getOpcode()){
+      case Instruction::FAdd: case Instruction::FSub: case Instruction::FMul:
+      case Instruction::FDiv: case Instruction::FRem:
+        return false;
+      default:
+        break;
+    }
+    return isa<SelectInst>(&I) || isa<PHINode>(&I) || isSupportedType(I.getOperand(0)->getType());
+  }
+  return false;
+}
+
+unsigned BytecodeCompiler::shiftOf(Type *ty) const {
+  if(ty->isPointerTy())
+    return 64 - DL.getPointerSizeInBits(ty->getPointerAddressSpace());
+  return 64 - ty->getIntegerBitWidth();
+}
+
+unsigned BytecodeCompiler::addReg(Value *V){
+  auto found = regs.find(V);
+  if(found != regs.end())
+    return found->second;
+  regs[V] = numRegs;
+  return numRegs++;
+}
+
+size_t BytecodeCompiler::emit(unsigned op, unsigned sh, unsigned dst, unsigned a,
+                              unsigned b, unsigned c){
+  size_t at = code.size();
+  uint8_t s[8] = {perm[op], (uint8_t)sh, (uint8_t)dst, (uint8_t)a, (uint8_t)b, (uint8_t)c, 0, 0};
+  code.insert(code.end(), s, s + 8);
+  return at;
+}
+
+void BytecodeCompiler::emitImm(unsigned dst, uint64_t v){
+  emit(BC_Li, 0, dst, 0, 0, 0);
+  for(unsigned i = 0; i < 8; i++){
+    unsigned byte = DL.isLittleEndian() ? i : 7 - i;
+    code.push_back((v >> (8 * byte)) & 0xFF);
+  }
+}
+
+void BytecodeCompiler::put16(size_t at, unsigned v){
+  code[at + (DL.isLittleEndian() ? 0 : 1)] = v & 0xFF;
+  code[at + (DL.isLittleEndian() ? 1 : 0)] = (v >> 8) & 0xFF;
+}
+
+// Parallel copy of the incoming values, through temporaries when several
+// phis of S could read each other
+void BytecodeCompiler::emitPhiMoves(BasicBlock *P, BasicBlock *S){
+  std::vector<PHINode *> phis;
+  for(PHINode &PN: S->phis())
+    phis.push_back(&PN);
+  if(phis.size() == 1){
+    emit(BC_Mov, 0, reg(phis[0]), reg(phis[0]->getIncomingValueForBlock(P)), 0, 0);
+    return;
+  }
+  for(PHINode *PN: phis)
+    emit(BC_Mov, 0, phiTemps[PN], reg(PN->getIncomingValueForBlock(P)), 0, 0);
+  for(PHINode *PN: phis)
+    emit(BC_Mov, 0, reg(PN), phiTemps[PN], 0, 0);
+}
+
+// Conditional edges into blocks with phis go through a stub holding the moves
+void BytecodeCompiler::emitTarget(size_t at, BasicBlock *P, BasicBlock *S){
+  if(S->phis().begin() == S->phis().end()){
+    fixups.push_back(std::make_pair(at, S));
+    return;
+  }
+  put16(at, code.size() / 8);
+  emitPhiMoves(P, S);
+  fixups.push_back(std::make_pair(emit(BC_Br, 0, 0, 0, 0, 0) + 4, S));
+}
+
+void BytecodeCompiler::emitGEP(GetElementPtrInst *GEP){
+  unsigned dst = reg(GEP), sh = shiftOf(GEP->getType());
+  int64_t offset = 0;
+  emit(BC_Mov, 0, dst, reg(GEP->getPointerOperand()), 0, 0);
+  for(gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E; ++GTI){
+    Value *idx = GTI.getOperand();
+    if(StructType *ST = GTI.getStructTypeOrNull()){
+      offset += DL.getStructLayout(ST)->getElementOffset(cast<ConstantInt>(idx)->getZExtValue());
+      continue;
+    }
+    uint64_t size = DL.getTypeAllocSize(GTI.getIndexedType());
+    if(ConstantInt *CI = dyn_cast<ConstantInt>(idx)){
+      offset += size * CI->getSExtValue();
+      continue;
+    }
+    emit(BC_SExt, shiftOf(idx->getType()), scratch, reg(idx), 0, 0);
+    emitImm(scratch + 1, size);
+    emit(BC_Mul, 0, scratch, scratch, scratch + 1, 0);
+    emit(BC_Add, sh, dst, dst, scratch, 0);
+  }
+  if(offset != 0){
+    emitImm(scratch + 1, offset);
+    emit(BC_Add, sh, dst, dst, scratch + 1, 0);
+  }
+}
+
+void BytecodeCompiler::emitInst(Instruction &I){
+  BasicBlock *BB = I.getParent();
+  if(BinaryOperator *BO = dyn_cast<BinaryOperator>(&I)){
+    unsigned op = 0;
+    switch(BO->getOpcode()){
+      case Instruction::Add: op = BC_Add; break;
+      case Instruction::Sub: op = BC_Sub; break;
+      case Instruction::Mul: op = BC_Mul; break;
+      case Instruction::UDiv: op = BC_UDiv; break;
+      case Instruction::SDiv: op = BC_SDiv; break;
+      case Instruction::URem: op = BC_URem; break;
+      case Instruction::SRem: op = BC_SRem; break;
+      case Instruction::Shl: op = BC_Shl; break;
+      case Instruction::LShr: op = BC_LShr; break;
+      case Instruction::AShr: op = BC_AShr; break;
+      case Instruction::And: op = BC_And; break;
+      case Instruction::Or: op = BC_Or; break;
+      default: op = BC_Xor; break;
+    }
+    emit(op, shiftOf(BO->getType()), reg(BO), reg(BO->getOperand(0)), reg(BO->getOperand(1)), 0);
+  }else if(ICmpInst *IC = dyn_cast<ICmpInst>(&I)){
+    if(!fusedCmp.count(IC))
+      emit(BC_ICmp + IC->getPredicate() - CmpInst::ICMP_EQ, shiftOf(IC->getOperand(0)->getType()),
+           reg(IC), reg(IC->getOperand(0)), reg(IC->getOperand(1)), 0);
+  }else if(SelectInst *SI = dyn_cast<SelectInst>(&I)){
+    emit(BC_Select, 0, reg(SI), reg(SI->getTrueValue()), reg(SI->getFalseValue()),
+         reg(SI->getCondition()));
+  }else if(SExtInst *SE = dyn_cast<SExtInst>(&I)){
+    emit(BC_SExt, shiftOf(SE->getSrcTy()), reg(SE), reg(SE->getOperand(0)), 0,
+         shiftOf(SE->getDestTy()));
+  }else if(CastInst *CI = dyn_cast<CastInst>(&I)){
+    // zext, trunc and pointer casts only need the result masked to its width
+    if(shiftOf(CI->getDestTy()) > shiftOf(CI->getSrcTy()))
+      emit(BC_Mask, shiftOf(CI->getDestTy()), reg(CI), reg(CI->getOperand(0)), 0, 0);
+    else
+      emit(BC_Mov, 0, reg(CI), reg(CI->getOperand(0)), 0, 0);
+  }else if(LoadInst *LI = dyn_cast<LoadInst>(&I)){
+    emit(BC_Load + Log2_64(DL.getTypeStoreSize(LI->getType())), 0, reg(LI),
+         reg(LI->getPointerOperand()), 0, 0);
+  }else if(StoreInst *SI = dyn_cast<StoreInst>(&I)){
+    emit(BC_Store + Log2_64(DL.getTypeStoreSize(SI->getValueOperand()->getType())), 0, 0,
+         reg(SI->getPointerOperand()), reg(SI->getValueOperand()), 0);
+  }else if(GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I)){
+    emitGEP(GEP);
+  }else if(ReturnInst *RI = dyn_cast<ReturnInst>(&I)){
+    emit(BC_Ret, 0, 0, RI->getNumOperands() ? reg(RI->getOperand(0)) : 0, 0, 0);
+  }else if(isa<UnreachableInst>(&I)){
+    emit(BC_Ret, 0, 0, 0, 0, 0);
+  }else if(BranchInst *BI = dyn_cast<BranchInst>(&I)){
+    if(BI->isUnconditional()){
+      emitPhiMoves(BB, BI->getSuccessor(0));
+      fixups.push_back(std::make_pair(emit(BC_Br, 0, 0, 0, 0, 0) + 4, BI->getSuccessor(0)));
+      return;
+    }
+    size_t at;
+    ICmpInst *IC = dyn_cast<ICmpInst>(BI->getCondition());
+    if(IC && fusedCmp.count(IC))
+      at = emit(BC_CmpBr + IC->getPredicate() - CmpInst::ICMP_EQ, shiftOf(IC->getOperand(0)->getType()),
+                reg(IC->getOperand(0)), reg(IC->getOperand(1)), 0, 0);
+    else
+      at = emit(BC_CBr, 0, 0, reg(BI->getCondition()), 0, 0);
+    emitTarget(at + 4, BB, BI->getSuccessor(0));
+    emitTarget(at + 6, BB, BI->getSuccessor(1));
+  }
+}
+
+bool BytecodeCompiler::compile(){
+  if(F.isDeclaration() || F.isVarArg())
+    return false;
+  if(!F.getReturnType()->isVoidTy() && !isSupportedType(F.getReturnType()))
+    return false;
+  for(Argument &A: F.args()){
+    if(!isSupportedType(A.getType()))
+      return false;
+  }
+  for(BasicBlock &BB: F){
+    for(Instruction &I: BB){
+      if(!isSupported(I))
+        return false;
+      if(isa<IntrinsicInst>(&I))
+        continue;
+      for(Value *op: I.operands()){
+        if(isa<BasicBlock>(op))
+          continue;
+        if(isa<Constant>(op) && !isSupportedType(op->getType()))
+          return false;
+      }
+    }
+  }
+
+  // Registers: live-ins first, then immediates, values and phi temporaries
+  for(Argument &A: F.args())
+    liveIns.push_back(&A);
+  for(Instruction &I: F.getEntryBlock()){
+    if(isa<AllocaInst>(&I))
+      liveIns.push_back(&I);
+  }
+  std::set<Constant *> seen;
+  for(BasicBlock &BB: F){
+    for(Instruction &I: BB){
+      if(isa<IntrinsicInst>(&I))
+        continue;
+      for(Value *op: I.operands()){
+        Constant *C = dyn_cast<Constant>(op);
+        if(!C || isa<BasicBlock>(op) || !seen.insert(C).second)
+          continue;
+        if(ConstantInt *CI = dyn_cast<ConstantInt>(C))
+          imms.push_back(std::make_pair(C, CI->getZExtValue()));
+        else if(isa<ConstantPointerNull>(C) || isa<UndefValue>(C))
+          imms.push_back(std::make_pair(C, 0));
+        else
+          liveIns.push_back(C);
+      }
+    }
+  }
+  // Live-ins are stored by the wrapper into the first registers
+  for(Value *V: liveIns)
+    addReg(V);
+  for(auto &imm: imms)
+    addReg(imm.first);
+  for(BasicBlock &BB: F){
+    for(Instruction &I: BB){
+      ICmpInst *IC = dyn_cast<ICmpInst>(&I);
+      if(IC && IC->hasOneUse() && IC->user_back() == BB.getTerminator() &&
+         isa<BranchInst>(BB.getTerminator())){
+        fusedCmp.insert(IC);
+        continue;
+      }
+      if(!I.getType()->isVoidTy() && !isa<AllocaInst>(&I) && !isa<IntrinsicInst>(&I))
+        addReg(&I);
+    }
+  }
+  for(BasicBlock &BB: F){
+    for(PHINode &PN: BB.phis())
+      phiTemps[&PN] = numRegs++;
+  }
+  scratch = numRegs;
+  numRegs += 2;
+  if(numRegs > maxRegs)
+    return false;
+
+  for(auto &imm: imms)
+    emitImm(reg(imm.first), imm.second);
+  for(BasicBlock &BB: F){
+    blockSlot[&BB] = code.size() / 8;
+    for(Instruction &I: BB)
+      emitInst(I);
+  }
+  for(auto &fixup: fixups)
+    put16(fixup.first, blockSlot[fixup.second]);
+  return code.size() / 8 <= UINT16_MAX;
+}
+
+void BytecodeCompiler::replaceBody(Function *interp){
+  Module &M = *F.getParent();
+  LLVMContext &C = M.getContext();
+  Type *i64 = Type::getInt64Ty(C);
+  std::vector<BasicBlock *> oldBB;
+  for(BasicBlock &BB: F)
+    oldBB.push_back(&BB);
+
+  ArrayType *codeTy = ArrayType::get(Type::getInt8Ty(C), code.size());
+  GlobalVariable *bytecode = new GlobalVariable(M, codeTy, true, GlobalValue::PrivateLinkage,
+                                                ConstantDataArray::get(C, code), "__YANSOLLVM_VM_Code");
+  bytecode->setAlignment(64);
+
+  BasicBlock *entry = BasicBlock::Create(C, "entry", &F, oldBB[0]);
+  IRBuilder<> Builder(entry);
+  ArrayType *regsTy = ArrayType::get(i64, numRegs);
+  Value *regFile = Builder.CreateAlloca(regsTy);
+  for(size_t i = 0; i < liveIns.size(); i++){
+    Value *V = liveIns[i];
+    if(AllocaInst *AI = dyn_cast<AllocaInst>(V)){
+      AllocaInst *NA = Builder.CreateAlloca(AI->getAllocatedType(), AI->getArraySize());
+      NA->setAlignment(AI->getAlignment());
+      V = NA;
+    }
+    if(V->getType()->isPointerTy())
+      V = Builder.CreatePtrToInt(V, i64);
+    else
+      V = Builder.CreateZExt(V, i64);
+    Builder.CreateStore(V, Builder.CreateConstInBoundsGEP2_64(regFile, 0, i));
+  }
+  Value *ret = Builder.CreateCall(interp, {Builder.CreateConstInBoundsGEP2_64(bytecode, 0, 0),
+                                           Builder.CreateConstInBoundsGEP2_64(regFile, 0, 0)});
+  Type *retTy = F.getReturnType();
+  if(retTy->isVoidTy())
+    Builder.CreateRetVoid();
+  else if(retTy->isPointerTy())
+    Builder.CreateRet(Builder.CreateIntToPtr(ret, retTy));
+  else
+    Builder.CreateRet(Builder.CreateTrunc(ret, retTy));
+
+  for(BasicBlock *BB: oldBB)
+    BB->dropAllReferences();
+  for(BasicBlock *BB: oldBB)
+    BB->eraseFromParent();
+}
+
+// Interpreter with threaded dispatch: every handler ends with its own
+// indirectbr through the per-build opcode table
+static Function *createInterpreter(Module &M, const std::vector<uint8_t> &perm){
+  LLVMContext &C = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  Type *i8 = Type::getInt8Ty(C), *i16 = Type::getInt16Ty(C), *i64 = Type::getInt64Ty(C);
+  Type *i8p = i8->getPointerTo();
+  FunctionType *funcTy = FunctionType::get(i64, {i8p, i64->getPointerTo()}, false);
+  Function *f = Function::Create(funcTy, GlobalValue::InternalLinkage, "__YANSOLLVM_VM_Interp", M);
+  addOrigin(f, "vm");
+  Function::arg_iterator itArgs = f->arg_begin(); Value *code = itArgs; Value *regs = ++itArgs;
+
+  BasicBlock *entry = BasicBlock::Create(C, "entry", f);
+  std::vector<BasicBlock *> handlers;
+  for(unsigned op = 0; op < BC_Num; op++)
+    handlers.push_back(BasicBlock::Create(C, "", f));
+  BasicBlock *trap = BasicBlock::Create(C, "", f);
+
+  ArrayType *tableTy = ArrayType::get(i8p, 256);
+  std::vector<Constant *> table(256, BlockAddress::get(f, trap));
+  for(unsigned op = 0; op < BC_Num; op++)
+    table[perm[op]] = BlockAddress::get(f, handlers[op]);
+  GlobalVariable *dispatchTable = new GlobalVariable(M, tableTy, true, GlobalValue::PrivateLinkage,
+                                                     ConstantArray::get(tableTy, table),
+                                                     "__YANSOLLVM_VM_Dispatch");
+
+  IRBuilder<> Builder(entry);
+  AllocaInst *pc = Builder.CreateAlloca(i64);
+  Builder.CreateStore(ConstantInt::get(i64, 0), pc);
+  std::vector<IndirectBrInst *> dispatches;
+  auto dispatch = [&](IRBuilder<> &B){
+    Value *pcv = B.CreateLoad(i64, pc);
+    Value *op = B.CreateLoad(i8, B.CreateInBoundsGEP(i8, code, pcv));
+    Value *target = B.CreateInBoundsGEP(tableTy, dispatchTable,
+                                        {ConstantInt::get(i64, 0), B.CreateZExt(op, i64)});
+    dispatches.push_back(B.CreateIndirectBr(B.CreateLoad(i8p, target), BC_Num + 1));
+  };
+  auto field = [&](IRBuilder<> &B, Value *pcv, unsigned k) -> Value *{
+    Value *p = B.CreateInBoundsGEP(i8, code, B.CreateAdd(pcv, ConstantInt::get(i64, k)));
+    return B.CreateZExt(B.CreateLoad(i8, p), i64);
+  };
+  auto field16 = [&](IRBuilder<> &B, Value *pcv, unsigned k) -> Value *{
+    Value *p = B.CreateInBoundsGEP(i8, code, B.CreateAdd(pcv, ConstantInt::get(i64, k)));
+    return B.CreateZExt(B.CreateLoad(i16, B.CreateBitCast(p, i16->getPointerTo())), i64);
+  };
+  auto regPtr = [&](IRBuilder<> &B, Value *pcv, unsigned k) -> Value *{
+    return B.CreateInBoundsGEP(i64, regs, field(B, pcv, k));
+  };
+  auto readReg = [&](IRBuilder<> &B, Value *pcv, unsigned k) -> Value *{
+    return B.CreateLoad(i64, regPtr(B, pcv, k));
+  };
+  auto mask = [&](IRBuilder<> &B, Value *v, Value *sh) -> Value *{
+    return B.CreateLShr(B.CreateShl(v, sh), sh);
+  };
+  auto sext = [&](IRBuilder<> &B, Value *v, Value *sh) -> Value *{
+    return B.CreateAShr(B.CreateShl(v, sh), sh);
+  };
+  auto next = [&](IRBuilder<> &B, Value *pcv, unsigned slots){
+    B.CreateStore(B.CreateAdd(pcv, ConstantInt::get(i64, 8 * slots)), pc);
+    dispatch(B);
+  };
+  auto jump = [&](IRBuilder<> &B, Value *cond, Value *pcv){
+    Value *target = B.CreateSelect(cond, field16(B, pcv, 4), field16(B, pcv, 6));
+    B.CreateStore(B.CreateShl(target, ConstantInt::get(i64, 3)), pc);
+    dispatch(B);
+  };
+  dispatch(Builder);
+
+  const Instruction::BinaryOps binOps[] = {
+    Instruction::Add, Instruction::Sub, Instruction::Mul, Instruction::UDiv, Instruction::SDiv,
+    Instruction::URem, Instruction::SRem, Instruction::Shl, Instruction::LShr, Instruction::AShr,
+    Instruction::And, Instruction::Or, Instruction::Xor};
+  for(unsigned op = BC_Add; op <= BC_Xor; op++){
+    IRBuilder<> B(handlers[op]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    Value *sh = field(B, pcv, 1);
+    Value *a = readReg(B, pcv, 3), *b = readReg(B, pcv, 4);
+    if(op == BC_SDiv || op == BC_SRem || op == BC_AShr)
+      a = sext(B, a, sh);
+    if(op == BC_SDiv || op == BC_SRem)
+      b = sext(B, b, sh);
+    B.CreateStore(mask(B, B.CreateBinOp(binOps[op - BC_Add], a, b), sh), regPtr(B, pcv, 2));
+    next(B, pcv, 1);
+  }
+  for(unsigned p = 0; p < 10; p++){
+    CmpInst::Predicate pred = (CmpInst::Predicate)(CmpInst::ICMP_EQ + p);
+    {
+      IRBuilder<> B(handlers[BC_ICmp + p]);
+      Value *pcv = B.CreateLoad(i64, pc);
+      Value *sh = field(B, pcv, 1);
+      Value *a = readReg(B, pcv, 3), *b = readReg(B, pcv, 4);
+      if(ICmpInst::isSigned(pred)){
+        a = sext(B, a, sh);
+        b = sext(B, b, sh);
+      }
+      B.CreateStore(B.CreateZExt(B.CreateICmp(pred, a, b), i64), regPtr(B, pcv, 2));
+      next(B, pcv, 1);
+    }
+    {
+      IRBuilder<> B(handlers[BC_CmpBr + p]);
+      Value *pcv = B.CreateLoad(i64, pc);
+      Value *sh = field(B, pcv, 1);
+      Value *a = readReg(B, pcv, 2), *b = readReg(B, pcv, 3);
+      if(ICmpInst::isSigned(pred)){
+        a = sext(B, a, sh);
+        b = sext(B, b, sh);
+      }
+      jump(B, B.CreateICmp(pred, a, b), pcv);
+    }
+  }
+  {
+    IRBuilder<> B(handlers[BC_Select]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    Value *cond = B.CreateICmpNE(readReg(B, pcv, 5), ConstantInt::get(i64, 0));
+    B.CreateStore(B.CreateSelect(cond, readReg(B, pcv, 3), readReg(B, pcv, 4)), regPtr(B, pcv, 2));
+    next(B, pcv, 1);
+  }
+  {
+    IRBuilder<> B(handlers[BC_Mov]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    B.CreateStore(readReg(B, pcv, 3), regPtr(B, pcv, 2));
+    next(B, pcv, 1);
+  }
+  {
+    IRBuilder<> B(handlers[BC_Li]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    Value *p = B.CreateInBoundsGEP(i8, code, B.CreateAdd(pcv, ConstantInt::get(i64, 8)));
+    B.CreateStore(B.CreateLoad(i64, B.CreateBitCast(p, i64->getPointerTo())), regPtr(B, pcv, 2));
+    next(B, pcv, 2);
+  }
+  {
+    IRBuilder<> B(handlers[BC_Mask]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    B.CreateStore(mask(B, readReg(B, pcv, 3), field(B, pcv, 1)), regPtr(B, pcv, 2));
+    next(B, pcv, 1);
+  }
+  {
+    IRBuilder<> B(handlers[BC_SExt]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    Value *v = sext(B, readReg(B, pcv, 3), field(B, pcv, 1));
+    B.CreateStore(mask(B, v, field(B, pcv, 5)), regPtr(B, pcv, 2));
+    next(B, pcv, 1);
+  }
+  {
+    IRBuilder<> B(handlers[BC_Br]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    jump(B, ConstantInt::getTrue(C), pcv);
+  }
+  {
+    IRBuilder<> B(handlers[BC_CBr]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    jump(B, B.CreateICmpNE(readReg(B, pcv, 3), ConstantInt::get(i64, 0)), pcv);
+  }
+  {
+    IRBuilder<> B(handlers[BC_Ret]);
+    Value *pcv = B.CreateLoad(i64, pc);
+    B.CreateRet(readReg(B, pcv, 3));
+  }
+  for(unsigned k = 0; k < 4; k++){
+    Type *ty = IntegerType::get(C, 8 << k);
+    unsigned ptrBits = DL.getPointerSizeInBits();
+    {
+      IRBuilder<> B(handlers[BC_Load + k]);
+      Value *pcv = B.CreateLoad(i64, pc);
+      Value *addr = B.CreateIntToPtr(B.CreateTrunc(readReg(B, pcv, 3), IntegerType::get(C, ptrBits)),
+                                     ty->getPointerTo());
+      B.CreateStore(B.CreateZExt(B.CreateAlignedLoad(ty, addr, 1), i64), regPtr(B, pcv, 2));
+      next(B, pcv, 1);
+    }
+    {
+      IRBuilder<> B(handlers[BC_Store + k]);
+      Value *pcv = B.CreateLoad(i64, pc);
+      Value *addr = B.CreateIntToPtr(B.CreateTrunc(readReg(B, pcv, 3), IntegerType::get(C, ptrBits)),
+                                     ty->getPointerTo());
+      B.CreateAlignedStore(B.CreateTrunc(readReg(B, pcv, 4), ty), addr, 1);
+      next(B, pcv, 1);
+    }
+  }
+  {
+    IRBuilder<> B(trap);
+    B.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap));
+    B.CreateUnreachable();
+  }
+
+  for(IndirectBrInst *IBI: dispatches){
+    for(BasicBlock *BB: handlers)
+      IBI->addDestination(BB);
+    IBI->addDestination(trap);
+  }
+  DominatorTree DT(*f);
+  PromoteMemToReg({pc}, DT);
+  return f;
+}
+
+// Functions marked with __attribute__((annotate("vm"))) or the
+// "vm-bytecode" attribute
+static std::set<Function *> getBytecodeTargets(Module &M){
+  std::set<Function *> targets;
+  for(Function &F: M){
+    if(F.hasFnAttribute("vm-bytecode"))
+      targets.insert(&F);
+  }
+  GlobalVariable *GA = M.getGlobalVariable("llvm.global.annotations");
+  if(!GA || !GA->hasInitializer())
+    return targets;
+  ConstantArray *CA = dyn_cast<ConstantArray>(GA->getInitializer());
+  if(!CA)
+    return targets;
+  for(Value *op: CA->operands()){
+    ConstantStruct *CS = dyn_cast<ConstantStruct>(op);
+    if(!CS || CS->getNumOperands() < 2)
+      continue;
+    Function *F = dyn_cast<Function>(CS->getOperand(0)->stripPointerCasts());
+    GlobalVariable *str = dyn_cast<GlobalVariable>(CS->getOperand(1)->stripPointerCasts());
+    if(!F || !str || !str->hasInitializer())
+      continue;
+    ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(str->getInitializer());
+    if(CDA && CDA->isCString() && CDA->getAsCString() == "vm")
+      targets.insert(F);
+  }
+  return targets;
+}
+
+bool virtualizeBytecode(Module &M){
+  std::set<Function *> annotated = getBytecodeTargets(M);
+  std::vector<Function *> targets;
+  for(Function &F: M){
+    // Wrappers of an earlier run keep their annotation
+    if(annotated.count(&F) && !hasOrigin(&F, "vm"))
+      targets.push_back(&F);
+  }
+  if(targets.empty())
+    return false;
+
+  // Opcode encoding is randomized per build
+  std::vector<uint8_t> perm(256);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), getRandomEngine());
+
+  Function *interp = nullptr;
+  bool modified = false;
+  for(Function *F: targets){
+    BytecodeCompiler BC(*F, perm);
+    if(!BC.compile()){
+      errs() << F->getName() << " cannot be compiled to bytecode\n";
+      continue;
+    }
+    if(!interp)
+      interp = createInterpreter(M, perm);
+    BC.replaceBody(interp);
+    addOrigin(F, "vm");
+    modified = true;
+  }
+  return modified;
+}